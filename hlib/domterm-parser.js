@@ -1222,6 +1222,10 @@ class DTParser {
                     break;
                 }
                 break;
+            case 93: // acknowledge chunks of a streamed paste
+                term._pasteAcked(this.getParameter(1, 0),
+                                 this.getParameter(2, 0));
+                break;
             case 96:
                 term._receivedCount = this.getParameter(1,0);
                 term._confirmedCount = term._receivedCount;
@@ -1236,7 +1240,7 @@ class DTParser {
                 break;
             case 99:
                 if (this.getParameter(1, 0) == 99)
-                    term.eofSeen();
+                    term.eofSeen(this.getParameter(2, -1));
                 break;
             }
         break;
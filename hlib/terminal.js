@@ -205,6 +205,10 @@ class Terminal {
     this._displayInfoWidget = null;
     this._displayInfoShowing = false;
     this._displaySizePendingTimeouts = 0;
+
+    // A large paste being streamed to the server (see _startPasteStream).
+    this._pasteStream = null;
+    this._pasteCounter = 0;
     this.modeLineGenerator = null;
 
     this._miscOptions = {};
@@ -527,6 +531,8 @@ Terminal.caretStyles = [null/*default*/, "blinking-block", "block",
 Terminal.DEFAULT_CARET_STYLE = 1; // blinking-block
 Terminal.NATIVE_CARET_STYLE = Terminal.caretStyles.indexOf("native");
 Terminal.INFO_TIMEOUT = 800;
+// How long a failed session's exit status is shown before closing.
+Terminal.EXIT_STATUS_TIMEOUT = 3000;
 
 DomTerm.makeElement = function(name, parent = DomTerm.layoutTop) {
     let topNode;
@@ -573,12 +579,22 @@ Terminal.prototype._deleteData = function(text, start, count) {
     }
 }
 
-Terminal.prototype.eofSeen = function() {
+/** The session ended.
+ * exitStatus is the exit status of its process, or -1 if unknown.
+ */
+Terminal.prototype.eofSeen = function(exitStatus = -1) {
     if (this.history) {
         this.historySave();
         this.history.length = 0;
     }
-    DomTerm.closeFromEof(this);
+    if (exitStatus > 0) {
+        // Show why the session ended, before closing the window.
+        var dt = this;
+        dt._displayInfoMessage("process exited with status "+exitStatus);
+        setTimeout(function() { DomTerm.closeFromEof(dt); },
+                   Terminal.EXIT_STATUS_TIMEOUT);
+    } else
+        DomTerm.closeFromEof(this);
 };
 
 DomTerm.isFrameParent = function() {
@@ -6581,13 +6597,101 @@ Terminal.prototype.pasteText = function(str) {
     if (editing) {
         this.editorAddLine();
         this.editorInsertString(str);
+    } else if (str.length > Terminal.PASTE_STREAM_THRESHOLD
+               && this._pasteStream == null) {
+        this._startPasteStream(str);
     } else {
-        this._addPendingInput(str);
-        if (this.sstate.bracketedPasteMode || this._lineEditingMode != 0)
-            this.reportText(str, null);
-        else
-            this.reportKeyEvent("paste", str);
+        this._sendPaste(str);
+    }
+};
+
+Terminal.prototype._sendPaste = function(str) {
+    this._addPendingInput(str);
+    if (this.sstate.bracketedPasteMode || this._lineEditingMode != 0)
+        this.reportText(str, null);
+    else
+        this.reportKeyEvent("paste", str);
+};
+
+/* A paste longer than PASTE_STREAM_THRESHOLD is sent as a stream of
+ * chunks (PASTE-DATA events), rather than in a single message.
+ * The server acknowledges chunks (with "\e[93;ID;COUNTu") once they
+ * have been written to the pty, and at most PASTE_WINDOW chunks are
+ * unacknowledged, so the paste goes at the rate the program reads it.
+ * Esc or Ctrl-C cancels the rest of the paste.
+ */
+Terminal.PASTE_STREAM_THRESHOLD = 65536;
+Terminal.PASTE_CHUNK_SIZE = 16384;
+Terminal.PASTE_WINDOW = 4;
+// If the server does not acknowledge PASTE-START (because it doesn't
+// support streaming), paste the usual way after this many milliseconds.
+Terminal.PASTE_START_TIMEOUT = 2000;
+
+Terminal.prototype._startPasteStream = function(str) {
+    let dt = this;
+    let id = this._pasteCounter = (this._pasteCounter + 1) & 0xffff;
+    let paste = { id: id, text: str, sent: 0, chunks: 0, acked: -1,
+                  ended: false };
+    this._pasteStream = paste;
+    this.reportEvent("PASTE-START",
+                     id+" "+(this.sstate.bracketedPasteMode?1:0)
+                     +" "+str.length);
+    setTimeout(function() {
+        if (dt._pasteStream == paste && paste.acked < 0) {
+            dt._pasteStream = null;
+            dt._sendPaste(str);
+        }
+    }, Terminal.PASTE_START_TIMEOUT);
+};
+
+Terminal.prototype._pasteSendMore = function() {
+    let paste = this._pasteStream;
+    let text = paste.text;
+    let len = text.length;
+    while (paste.chunks - paste.acked < Terminal.PASTE_WINDOW
+           && paste.sent < len) {
+        let end = Math.min(paste.sent + Terminal.PASTE_CHUNK_SIZE, len);
+        // Don't split a surrogate pair.
+        let last = text.charCodeAt(end-1);
+        if (end < len && last >= 0xD800 && last < 0xDC00)
+            end--;
+        this.reportEvent("PASTE-DATA", paste.id+" "+paste.chunks+" "
+                         +JSON.stringify(text.substring(paste.sent, end)));
+        paste.sent = end;
+        paste.chunks++;
+    }
+    if (paste.sent == len && ! paste.ended) {
+        this.reportEvent("PASTE-END", ""+paste.id);
+        paste.ended = true;
+    }
+};
+
+/** Handle the server's acknowledgement of count chunks of paste id. */
+Terminal.prototype._pasteAcked = function(id, count) {
+    let paste = this._pasteStream;
+    if (paste == null || paste.id != id)
+        return;
+    paste.acked = count;
+    if (paste.ended && count == paste.chunks) {
+        this._pasteStream = null;
+        this._clearInfoMessage();
+        return;
     }
+    this._pasteSendMore();
+    let percent = Math.floor(100 * count * Terminal.PASTE_CHUNK_SIZE
+                             / paste.text.length);
+    this._displayInfoMessage("Pasting: "+Math.min(percent, 99)
+                             +"% (Esc to cancel)");
+};
+
+Terminal.prototype.cancelPasteStream = function() {
+    let paste = this._pasteStream;
+    if (paste == null)
+        return false;
+    this.reportEvent("PASTE-CANCEL", ""+paste.id);
+    this._pasteStream = null;
+    this._displayInfoWithTimeout("Paste cancelled");
+    return true;
 };
 
 DomTerm.copyLink = function(element=DomTerm._contextLink) {
@@ -7141,6 +7245,12 @@ Terminal.prototype.keyDownHandler = function(event) {
         return;
     if (this._composing == 0)
         this._composing = -1;
+    if (this._pasteStream != null
+        && (keyName == "Esc" || keyName == "Ctrl-C")
+        && this.cancelPasteStream()) {
+        event.preventDefault();
+        return;
+    }
     if (DomTerm.handleKey(DomTerm.masterKeymap, this, keyName)) {
         event.preventDefault();
         return;
@@ -7479,9 +7589,12 @@ DomTerm.initXtermJs = function(dt, topNode) {
                                                            params[2]!=0,
                                                            params[3]-1);
                                        return true;
+                                   case 93:
+                                       dt._pasteAcked(params[1], params[2]);
+                                       return true;
                                    case 99:
                                        if (params[1]==99) {
-                                           dt.eofSeen();
+                                           dt.eofSeen(params.length > 2 ? params[2] : -1);
                                            return true;
                                        }
                                        break;
@@ -500,6 +500,19 @@ int status_action(int argc, char** argv, const char*cwd,
               fprintf(out, ", name: %s\n", pclient->session_name); // FIXME-quote?
             if (pclient->paused)
                 fprintf(out, ", paused");
+            if (pclient->flooding)
+                fprintf(out, ", flooding");
+            else if (pclient->bulk_output)
+                fprintf(out, ", bulk output");
+            struct termios *tio = pty_termios(pclient);
+            if (tio != NULL)
+                fprintf(out, ", %s %s",
+                        (tio->c_lflag & ICANON) != 0 ? "icanon" : "-icanon",
+                        (tio->c_lflag & ECHO) != 0 ? "echo" : "-echo");
+            if (pclient->spool != NULL && pclient->spool->length > 0)
+                fprintf(out, ", saved output: %ld bytes (%ld compressed)",
+                        (long) pclient->spool->length,
+                        (long) pclient->spool->compressed);
             fprintf(out, "\n");
             int nwindows = 0;
             struct lws *w;
@@ -525,6 +538,13 @@ int status_action(int argc, char** argv, const char*cwd,
                 if (json_print_property(out, vobj, "firefox", prefix, NULL))
                     prefix = ", ";
                 //fprintf(out, " %s\n", tclient->version_info);
+                if (tclient->rtt > 0) {
+                    fprintf(out, "%srtt: %.1fms, window: %ld", prefix,
+                            tclient->rtt / 1000.0, tclient->window);
+                    prefix = ", ";
+                }
+                if (tclient->lagging)
+                    fprintf(out, "%slagging", prefix);
                 fprintf(out, "\n");
                 json_object_put(vobj);
                 nwindows++;
@@ -627,6 +647,20 @@ int reverse_video_action(int argc, char** argv, const char*cwd,
     return EXIT_SUCCESS;
 }
 
+/* "domterm batch" is handled by the client (see run_batch in server.c);
+ * this is only reached if a server is asked to run it.
+ */
+int batch_action(int argc, char** argv, const char*cwd,
+                 char **env, struct lws *wsi,
+                 struct options *opts)
+{
+    char *msg = "domterm batch: cannot be run by the server\n";
+    if (write(opts->fd_err, msg, strlen(msg)) <= 0)
+        lwsl_err("write failed\n");
+    close(opts->fd_err);
+    return EXIT_FAILURE;
+}
+
 struct command commands[] = {
   { .name = "is-domterm",
     .options = COMMAND_IN_CLIENT,
@@ -682,6 +716,8 @@ struct command commands[] = {
     .action = help_action },
   { .name = "new", .options = COMMAND_IN_SERVER,
     .action = new_action},
+  { .name = "batch", .options = COMMAND_WITH_SERVER,
+    .action = batch_action},
   { .name = 0 }
   };
 
@@ -1,5 +1,8 @@
 #include "server.h"
 //#include "html.h"
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
 
 #if HAVE_OPENSSL
 #include <openssl/ssl.h>
@@ -161,6 +164,91 @@ bool check_server_key(struct lws *wsi, char *arg, size_t alen)
 }
 
 #define LBUFSIZE 4096
+
+// Bounds on how much of a response body is written per callback.
+#define HTTP_CHUNK_MIN 4096
+#define HTTP_CHUNK_MAX (256*1024)
+
+/* How much of a response body to write now: about the free space in
+ * the socket's send buffer (which grows as the kernel tunes the
+ * connection), so lws rarely has to buffer a partial write.
+ * Bodies are written without LWS_PRE headroom, so this is only for
+ * http/1 (which needs none).
+ */
+static int
+http_chunk_size(struct lws *wsi)
+{
+#ifdef SIOCOUTQ
+    int sockfd = lws_get_socket_fd(wsi);
+    int sndbuf, queued;
+    socklen_t slen = sizeof(sndbuf);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &slen) == 0
+        && ioctl(sockfd, SIOCOUTQ, &queued) == 0) {
+        // Linux reports double the usable size (to allow for overhead).
+        int room = sndbuf / 2 - queued;
+        return room < HTTP_CHUNK_MIN ? HTTP_CHUNK_MIN
+            : room > HTTP_CHUNK_MAX ? HTTP_CHUNK_MAX
+            : room;
+    }
+#endif
+    return HTTP_CHUNK_MIN * 4;
+}
+
+/* Start writing a response body, after the headers. */
+static int
+write_response_body(struct lws *wsi, struct http_client *hclient,
+                    unsigned char *content_data, unsigned int content_length,
+                    bool owns_data)
+{
+    hclient->owns_data = owns_data;
+    hclient->data = content_data;
+    hclient->ptr = content_data;
+    hclient->length = content_length;
+    /* write the body separately */
+    lws_callback_on_writable(wsi);
+    return 0;
+}
+
+/* Read the next part of a response's file, into its data buffer.
+ * Returns false if the file could not be read (or got shorter).
+ */
+static bool
+http_read_file(struct http_client *hclient)
+{
+    size_t want = hclient->file_remaining > HTTP_CHUNK_MAX ? HTTP_CHUNK_MAX
+        : hclient->file_remaining;
+    ssize_t n;
+    while ((n = read(hclient->file_fd, hclient->data, want)) < 0
+           && errno == EINTR)
+        ;
+    if (n <= 0) {
+        lwsl_err("reading file for http response failed\n");
+        return false;
+    }
+    hclient->ptr = hclient->data;
+    hclient->length = n;
+    hclient->file_remaining -= n;
+    if (hclient->file_remaining == 0)
+        close(hclient->file_fd);
+    return true;
+}
+
+/* Release what a response was written from (when done or closed). */
+static void
+http_response_done(struct http_client *hclient)
+{
+    if (hclient->owns_data)
+        free(hclient->data);
+    hclient->owns_data = false;
+    hclient->data = NULL;
+    hclient->ptr = NULL;
+    hclient->length = 0;
+    if (hclient->file_remaining > 0)
+        close(hclient->file_fd);
+    hclient->file_remaining = 0;
+    hclient->trailer = NULL;
+}
+
 int
 write_simple_response(struct lws *wsi, struct http_client *hclient,
                       const char *content_type,
@@ -177,15 +265,116 @@ write_simple_response(struct lws *wsi, struct http_client *hclient,
     if (lws_finalize_write_http_header(wsi, start, &p, end))
         return 1;
 
-    hclient->owns_data = owns_data;
-    hclient->data = content_data;
-    hclient->ptr = content_data;
-    hclient->length = content_length;
-    /* write the body separately */
-    lws_callback_on_writable(wsi);
-    return 0;
+    return write_response_body(wsi, hclient, content_data, content_length,
+                               owns_data);
 }
 
+#if COMPILED_IN_RESOURCES
+static struct resource *
+find_resource(const char *name)
+{
+    int i = resource_index[resource_hash(name, resource_hash_seed)
+                           & resource_index_mask];
+    return i >= 0 && strcmp(resources[i].name, name) == 0 ? &resources[i]
+        : NULL;
+}
+
+/* True if the request's Accept-Encoding allows gzip (with a non-zero q). */
+static bool
+accepts_gzip(struct lws *wsi)
+{
+    int hlen = lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_ACCEPT_ENCODING);
+    if (hlen <= 0)
+        return false;
+    char hbuf[hlen + 1];
+    if (lws_hdr_copy(wsi, hbuf, sizeof(hbuf),
+                     WSI_TOKEN_HTTP_ACCEPT_ENCODING) <= 0)
+        return false;
+    int gzip = -1, any = -1; // -1: not mentioned; else 0 or 1
+    char *save = NULL;
+    for (char *tok = strtok_r(hbuf, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save)) {
+        while (*tok == ' ' || *tok == '\t')
+            tok++;
+        size_t nlen = strcspn(tok, "; \t");
+        bool ok = true;
+        char *q = strstr(tok + nlen, "q=");
+        if (q != NULL)
+            ok = strtod(q + 2, NULL) > 0;
+        if ((nlen == 4 && strncasecmp(tok, "gzip", 4) == 0)
+            || (nlen == 6 && strncasecmp(tok, "x-gzip", 6) == 0))
+            gzip = ok;
+        else if (nlen == 1 && tok[0] == '*')
+            any = ok;
+    }
+    return gzip >= 0 ? gzip : any > 0;
+}
+
+/* True if a request header contains str. */
+static bool
+header_contains(struct lws *wsi, enum lws_token_indexes token,
+                const char *str)
+{
+    int hlen = lws_hdr_total_length(wsi, token);
+    if (hlen <= 0)
+        return false;
+    char hbuf[hlen + 1];
+    return lws_hdr_copy(wsi, hbuf, sizeof(hbuf), token) > 0
+        && strstr(hbuf, str) != NULL;
+}
+
+static int
+add_header(struct lws *wsi, const char *name, const char *value,
+           unsigned char **p, unsigned char *end)
+{
+    return lws_add_http_header_by_name(wsi, (const unsigned char *) name,
+                                       (const unsigned char *) value,
+                                       strlen(value), p, end);
+}
+
+/* Respond with a compiled-in resource.
+ * Uses the gzip-compressed copy if the browser accepts it, and
+ * responds "304 Not Modified" if the browser's copy is current.
+ * Returns like write_simple_response, or 1 if the (header-only)
+ * response is complete.
+ */
+static int
+write_resource_response(struct lws *wsi, struct http_client *hclient,
+                        struct resource *resource, const char *content_type,
+                        unsigned char *buffer)
+{
+    uint8_t *start = buffer+LWS_PRE, *p = start,
+        *end = &buffer[LBUFSIZE - LWS_PRE - 1];
+    bool not_modified = header_contains(wsi, WSI_TOKEN_HTTP_IF_NONE_MATCH,
+                                        resource->etag);
+    bool gzip = resource->gzip_data != NULL
+        && accepts_gzip(wsi);
+    unsigned char *data = gzip ? resource->gzip_data : resource->data;
+    unsigned int length = gzip ? resource->gzip_length : resource->length;
+    // The URLs are not versioned, and a port may be reused by an
+    // updated server, so browsers must check the ETag (which is cheap).
+    const char *cache_control = "no-cache";
+    if (not_modified) {
+        if (lws_add_http_header_status(wsi, HTTP_STATUS_NOT_MODIFIED,
+                                       &p, end))
+            return -1;
+    } else if (lws_add_http_common_headers(wsi, HTTP_STATUS_OK,
+                                           content_type, length, &p, end))
+        return -1;
+    if (add_header(wsi, "etag:", resource->etag, &p, end)
+        || add_header(wsi, "cache-control:", cache_control, &p, end)
+        || (resource->gzip_data != NULL
+            && add_header(wsi, "vary:", "Accept-Encoding", &p, end))
+        || (gzip && ! not_modified
+            && add_header(wsi, "content-encoding:", "gzip", &p, end))
+        || lws_finalize_write_http_header(wsi, start, &p, end))
+        return -1;
+    if (not_modified)
+        return 1;
+    return write_response_body(wsi, hclient, data, length, false);
+}
+#endif
+
 /** Callack for servering http - generally static files. */
 
 int
@@ -253,40 +442,48 @@ callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, voi
                 int blen = lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_URI_ARGS);
                 char *buf = xmalloc(blen+1);
                 const char *filename = NULL;
-                FILE *sfile = NULL;
                 struct stat stbuf;
-                off_t slen;
                 int fd = -1;
                 int ret = -1;
                 if (check_server_key(wsi, buf, blen)
                     && (filename = lws_get_urlarg_by_name(wsi, "file=", buf, blen)) != NULL
-                    && (fd = open(filename, O_RDONLY)) >= 0
+                    && (fd = open(filename, O_RDONLY|O_CLOEXEC)) >= 0
                     && fstat(fd, &stbuf) == 0
-                    && (slen = stbuf.st_size) > 0
-                    && (buf = realloc(buf, slen)) != NULL
-                    && (sfile = fdopen(fd, "r")) != NULL
-                    && fread(buf, 1, slen, sfile) == slen) {
-                    struct sbuf sb[1];
-                    sbuf_init(sb);
+                    && stbuf.st_size > 0) {
+                    // The file is streamed between the page's head and
+                    // end (see LWS_CALLBACK_HTTP_WRITEABLE), so memory use
+                    // doesn't depend on its size.
                     // FIXME: We should encrypt the response (perhaps just a
                     // simple encryption using the kerver_key).  It is probably
                     // not an issue for local requests, and for non-local
                     // requests (where one should use tls or ssh).
-                    make_html_text(sb, http_port, LIB_WHEN_SIMPLE, buf, slen);
-                    char *data = sb->buffer;
-                    int dlen = sb->len;
-                    sb->buffer = NULL;
-                    sbuf_free(sb);
-                    ret = write_simple_response(wsi, hclient, "text/html",
-                                                data, dlen,
-                                                true, buffer);
-                    buf = NULL; // buf is now owned by write_simple_response
+                    struct sbuf sb[1];
+                    sbuf_init(sb);
+                    make_html_head(sb, http_port, LIB_WHEN_SIMPLE);
+                    size_t head_length = sb->len;
+                    // The buffer is then used for reading the file.
+                    sbuf_extend(sb, HTTP_CHUNK_MAX);
+                    p = start;
+                    end = &buffer[LBUFSIZE - LWS_PRE - 1];
+                    if (lws_add_http_common_headers(wsi, HTTP_STATUS_OK,
+                                                    "text/html",
+                                                    head_length + stbuf.st_size
+                                                    + strlen(html_text_end),
+                                                    &p, end)
+                        || lws_finalize_write_http_header(wsi, start,
+                                                          &p, end)) {
+                        sbuf_free(sb);
+                    } else {
+                        ret = write_response_body(wsi, hclient, sb->buffer,
+                                                  head_length, true);
+                        hclient->file_fd = fd;
+                        hclient->file_remaining = stbuf.st_size;
+                        hclient->trailer = html_text_end;
+                        fd = -1; // now owned by hclient
+                    }
                 }
-                if (buf != NULL)
-                    free(buf);
-                if (sfile != NULL)
-                    fclose(sfile);
-                else if (fd >= 0)
+                free(buf);
+                if (fd >= 0)
                     close(fd);
                 return ret;
             }
@@ -320,13 +517,13 @@ callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, voi
                                              true, buffer);
             }
 #if COMPILED_IN_RESOURCES
-            struct resource *resource = &resources[0];
-            while (resource->name != NULL && strcmp(resource->name, fname+1) != 0)
-                resource++;
-            if (resource->name != NULL) {
-                return write_simple_response(wsi, hclient, content_type,
-                                             resource->data, resource->length,
-                                             false, buffer);
+            struct resource *resource = find_resource(fname+1);
+            if (resource != NULL) {
+                int r = write_resource_response(wsi, hclient, resource,
+                                                content_type, buffer);
+                if (r > 0)
+                    goto try_to_reuse;
+                return r < 0 ? 1 : 0;
             }
             lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL);
             goto try_to_reuse;
@@ -339,22 +536,29 @@ callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, voi
 #endif
 
         case LWS_CALLBACK_HTTP_WRITEABLE:
+            if (hclient->length == 0 && hclient->file_remaining > 0
+                && ! http_read_file(hclient))
+                return 1;
+            if (hclient->length == 0 && hclient->trailer != NULL) {
+                hclient->ptr = (char *) hclient->trailer;
+                hclient->length = strlen(hclient->trailer);
+                hclient->trailer = NULL;
+            }
             if (hclient->length) {
-                int max_chunk = 2000;
+                int max_chunk = http_chunk_size(wsi);
                 int cur_chunk = hclient->length > max_chunk ? max_chunk : hclient->length;
                 hclient->length -= cur_chunk;
+                bool more = hclient->length > 0
+                    || hclient->file_remaining > 0 || hclient->trailer != NULL;
                 if (lws_write(wsi, (uint8_t *)hclient->ptr, cur_chunk,
-                              hclient->length > 0 ? LWS_WRITE_HTTP : LWS_WRITE_HTTP_FINAL)
+                              more ? LWS_WRITE_HTTP : LWS_WRITE_HTTP_FINAL)
                     != cur_chunk)
                     return 1;
-                if (hclient->length > 0) {
+                if (more) {
                     hclient->ptr += cur_chunk;
                     lws_callback_on_writable(wsi);
                 } else {
-                    if (hclient->owns_data)
-                        free(hclient->data);
-                    hclient->data = NULL;
-                    hclient->ptr = NULL;
+                    http_response_done(hclient);
                     if (lws_http_transaction_completed(wsi))
                         return -1;
                 }
@@ -362,6 +566,11 @@ callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, voi
             }
             break;
 
+        case LWS_CALLBACK_CLOSED_HTTP:
+            if (hclient != NULL)
+                http_response_done(hclient);
+            return lws_callback_http_dummy(wsi, reason, user, in, len);
+
 	case LWS_CALLBACK_HTTP_FILE_COMPLETION:
             if (lws_http_transaction_completed(wsi))
               return -1; /* error or can't reuse connection: close the socket */
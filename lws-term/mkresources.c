@@ -0,0 +1,164 @@
+/* Generate resources.c, for configure --enable-compiled-in-resources.
+ *
+ * Usage: mkresources DIRECTORY FILE... >resources.c
+ *
+ * Each FILE (relative to DIRECTORY) is included as-is and, if that is
+ * smaller, gzip-compressed, with an ETag computed from its contents.
+ * The names are indexed by a perfect hash (see resources.h), so
+ * callback_http finds a resource with a single string comparison.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "resources.h"
+
+struct input {
+    char *name;
+    unsigned char *data;
+    size_t length;
+    unsigned char *gzip_data;
+    size_t gzip_length;
+};
+
+static void
+fail(const char *what, const char *name)
+{
+    fprintf(stderr, "mkresources: %s %s\n", what, name);
+    exit(EXIT_FAILURE);
+}
+
+static void
+read_input(const char *dir, struct input *in)
+{
+    char *path = malloc(strlen(dir) + strlen(in->name) + 2);
+    sprintf(path, "%s/%s", dir, in->name);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        fail("cannot open", path);
+    size_t size = 65536;
+    in->data = malloc(size);
+    in->length = 0;
+    size_t n;
+    while ((n = fread(in->data + in->length, 1, size - in->length, f)) > 0) {
+        in->length += n;
+        if (in->length == size)
+            in->data = realloc(in->data, size *= 2);
+    }
+    if (ferror(f))
+        fail("cannot read", path);
+    fclose(f);
+    free(path);
+}
+
+/* Compress with gzip framing (and no timestamp, so builds are repeatable). */
+static void
+compress_input(struct input *in)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16,
+                     9, Z_DEFAULT_STRATEGY) != Z_OK)
+        fail("cannot compress", in->name);
+    size_t size = deflateBound(&zs, in->length);
+    in->gzip_data = malloc(size);
+    zs.next_in = in->data;
+    zs.avail_in = in->length;
+    zs.next_out = in->gzip_data;
+    zs.avail_out = size;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+        fail("cannot compress", in->name);
+    in->gzip_length = zs.total_out;
+    deflateEnd(&zs);
+    if (in->gzip_length >= in->length) {
+        free(in->gzip_data);
+        in->gzip_data = NULL;
+    }
+}
+
+static void
+print_bytes(const char *var, int i, const unsigned char *data, size_t length)
+{
+    printf("static unsigned char %s%d[] = {", var, i);
+    for (size_t j = 0; j < length; j++)
+        printf(j % 12 == 0 ? "\n  0x%02x," : " 0x%02x,", data[j]);
+    printf("\n};\n");
+}
+
+/* Find a seed for which resource_hash has no collisions in size slots.
+ * Returns the seed, or -1 if none was found quickly.
+ */
+static long
+find_seed(struct input *inputs, int count, unsigned int size, short *index)
+{
+    for (long seed = 0; seed < 100000; seed++) {
+        int i;
+        memset(index, -1, size * sizeof(short));
+        for (i = 0; i < count; i++) {
+            unsigned int slot = resource_hash(inputs[i].name, seed) & (size-1);
+            if (index[slot] >= 0)
+                break;
+            index[slot] = i;
+        }
+        if (i == count)
+            return seed;
+    }
+    return -1;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: mkresources DIRECTORY FILE...\n");
+        return EXIT_FAILURE;
+    }
+    int count = argc - 2;
+    struct input *inputs = calloc(count + 1, sizeof(struct input));
+    for (int i = 0; i < count; i++) {
+        inputs[i].name = argv[i + 2];
+        read_input(argv[1], &inputs[i]);
+        compress_input(&inputs[i]);
+    }
+
+    unsigned int size = 1;
+    while (size < 2 * count)
+        size <<= 1;
+    short *index = malloc(size * sizeof(short));
+    long seed;
+    while ((seed = find_seed(inputs, count, size, index)) < 0)
+        index = realloc(index, (size <<= 1) * sizeof(short));
+
+    printf("/* Generated by mkresources - do not edit. */\n"
+           "#include \"server.h\"\n\n");
+    for (int i = 0; i < count; i++) {
+        print_bytes("resource_data_", i, inputs[i].data, inputs[i].length);
+        if (inputs[i].gzip_data != NULL)
+            print_bytes("resource_gzip_", i,
+                        inputs[i].gzip_data, inputs[i].gzip_length);
+    }
+    printf("\nstruct resource resources[] = {\n");
+    for (int i = 0; i < count; i++) {
+        struct input *in = &inputs[i];
+        // The ETag is a FNV-1a hash of the contents, and the length.
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t j = 0; j < in->length; j++)
+            h = (h ^ in->data[j]) * 1099511628211ULL;
+        printf("    { \"%s\", resource_data_%d, %zu,\n", in->name, i, in->length);
+        if (in->gzip_data != NULL)
+            printf("      resource_gzip_%d, %zu,\n", i, in->gzip_length);
+        else
+            printf("      NULL, 0,\n");
+        printf("      \"\\\"%016llx-%zx\\\"\" },\n",
+               (unsigned long long) h, in->length);
+    }
+    printf("    { NULL, NULL, 0, NULL, 0, NULL }\n};\n\n");
+    printf("short resource_index[] = {");
+    for (unsigned int slot = 0; slot < size; slot++)
+        printf(slot % 16 == 0 ? "\n  %d," : " %d,", index[slot]);
+    printf("\n};\n");
+    printf("unsigned int resource_index_mask = 0x%x;\n", size - 1);
+    printf("uint32_t resource_hash_seed = %ld;\n", seed);
+    return EXIT_SUCCESS;
+}
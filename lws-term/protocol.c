@@ -5,9 +5,27 @@
 #include <utmp.h>
 
 #define BUF_SIZE 1024
+#define READ_CHUNK 4096
 
 #define USE_RXFLOW (LWS_LIBRARY_VERSION_NUMBER >= (2*1000000+4*1000))
-#define UNCONFIRMED_LIMIT 8000
+// How long a minimum round-trip time measurement stays valid.
+#define MIN_RTT_LIFETIME (10*1000000)
+// Output rate is measured over intervals of this many microseconds.
+#define FLOOD_INTERVAL 250000
+// Number of consecutive fast intervals before switching to flood mode.
+#define FLOOD_INTERVALS 2
+// Don't delay sending output once this much is waiting.
+#define FLUSH_SIZE (16*1024)
+// Time constant (in microseconds) of the recent input and output levels.
+#define LEVEL_DECAY 1000000
+// Output is bulk if there are more than this many bytes per input event,
+#define BULK_RATIO 4096
+// and there was no input in the last ECHO_TIME microseconds.
+#define ECHO_TIME 50000
+// Larger message buffers of a window are freed after use.
+#define WRITE_BUFFER_KEEP (64*1024)
+// Most runs of plain input written with one writev call.
+#define RECEIVE_IOV_MAX 16
 
 #if defined(TIOCPKT)
 // See https://stackoverflow.com/questions/21641754/when-pty-pseudo-terminal-slave-fd-settings-are-changed-by-tcsetattr-how-ca
@@ -22,6 +40,8 @@ static char request_contents_message[] =
     OUT_OF_BAND_START_STRING "\033[81u" URGENT_END_STRING;
 #define URGENT_WRAP(STR)  URGENT_START_STRING STR URGENT_END_STRING
 
+// Clear a window (including its scrollback) before a new snapshot.
+static char resync_reset[] = "\033[?1049l\033c\033[H\033[2J\033[3J";
 static char start_replay_mode[] = "\033[97u";
 static char end_replay_mode[] = "\033[98u";
 
@@ -91,6 +111,703 @@ should_backup_output(struct pty_client *pclient)
     return true;
 }
 
+/** Discard output that has been sent to every client.
+ * Output since a window-contents request is kept (preserved) until
+ * the resulting saved_window_contents is no longer needed.
+ */
+static void
+trim_output(struct pty_client *pclient)
+{
+    struct ring *output = pclient->output;
+    long min_pos = output->end;
+    bool requesting = false;
+    struct lws *twsi;
+    FOREACH_WSCLIENT(twsi, pclient) {
+        struct tty_client *tclient = (struct tty_client *) lws_wsi_user(twsi);
+        if (tclient->lagging)
+            continue;
+        if (tclient->output_pos < min_pos)
+            min_pos = tclient->output_pos;
+        if (tclient->requesting_contents == 2)
+            requesting = true;
+    }
+    if (pclient->preserving && ! requesting
+        && pclient->saved_window_contents == NULL)
+        pclient->preserving = false;
+    if ((pclient->preserving || pclient->screen == NULL)
+        && pclient->first_client_wsi == NULL
+        && main_options->detached_output_limit > 0) {
+        // No window is attached: move preserved output to the spool.
+        // Without saved contents (or a screen model) all output is
+        // spooled, so a window that attaches later can replay it.
+        if (pclient->spool == NULL)
+            pclient->spool = spool_new(main_options->detached_output_limit);
+        long pos = pclient->preserving ? pclient->preserved_start
+            : output->start;
+        long start = pos;
+        while (pos < output->end) {
+            char *data;
+            size_t n = ring_span(output, pos, output->end, &data);
+            spool_append(pclient->spool, data, n);
+            pos += n;
+        }
+        if (pclient->preserving) {
+            pclient->preserved_sent_count =
+                (pclient->preserved_sent_count + (pos - start)) & MASK28;
+            pclient->preserved_start = pos;
+        }
+    }
+    if (pclient->preserving && pclient->preserved_start < min_pos)
+        min_pos = pclient->preserved_start;
+    ring_consume(output, min_pos);
+}
+
+/** True if a session without windows should keep reading its output
+ * (into the screen model or the spool), rather than pause.
+ */
+static bool
+should_drain(struct pty_client *pclient)
+{
+    return pclient->first_client_wsi == NULL
+        && main_options->detached_output_limit > 0;
+}
+
+/* With several service threads, a wsi may only be changed (by
+ * lws_callback_on_writable, lws_rx_flow_control or lws_set_timeout)
+ * in its own thread.  For a wsi of another thread we record the request,
+ * and wake that thread, which does it in run_thread_requests.
+ * A session's pty_wsi is pinned to the thread lws picked when adopting it,
+ * which pty_adopted records.
+ */
+static struct tty_client *tty_requests = NULL; // with requests != 0
+#define REQUEST_WRITABLE 1
+#define REQUEST_RESUME_INPUT 2
+
+static bool
+pty_on_this_thread(struct pty_client *pclient)
+{
+    return service_threads <= 1 || pclient->tsi == service_tsi;
+}
+
+static void
+wake_pty_thread(struct pty_client *pclient)
+{
+#if USE_SERVICE_THREADS
+    if (pclient->tsi >= 0)
+        lws_cancel_service_pt(pclient->pty_wsi);
+#endif
+}
+
+/* Returns false if the request must be done by the window's thread,
+ * in which case it is queued for that thread.
+ */
+static bool
+tty_on_this_thread(struct tty_client *tclient, char request)
+{
+#if USE_SERVICE_THREADS
+    if (service_threads > 1 && tclient->tsi != service_tsi) {
+        if (tclient->requests == 0) {
+            tclient->next_request = tty_requests;
+            tty_requests = tclient;
+        }
+        tclient->requests |= request;
+        lws_cancel_service_pt(tclient->wsi);
+        return false;
+    }
+#endif
+    return true;
+}
+
+/** Like lws_callback_on_writable, for a window of any thread. */
+void
+request_writable(struct lws *wsi)
+{
+    struct tty_client *tclient = (struct tty_client *) lws_wsi_user(wsi);
+    if (tty_on_this_thread(tclient, REQUEST_WRITABLE))
+        lws_callback_on_writable(wsi);
+}
+
+/* Read input from a window again (see pty_write). */
+static void
+resume_input(struct tty_client *tclient)
+{
+    if (tclient->input_paused
+        && tty_on_this_thread(tclient, REQUEST_RESUME_INPUT)) {
+        tclient->input_paused = false;
+#if USE_RXFLOW
+        lws_rx_flow_control(tclient->wsi, 1);
+#endif
+    }
+}
+
+static void
+request_pty_writable(struct pty_client *pclient)
+{
+    if (pty_on_this_thread(pclient))
+        lws_callback_on_writable(pclient->pty_wsi);
+    else {
+        pclient->writable_requested = true;
+        wake_pty_thread(pclient);
+    }
+}
+
+static void
+close_pty(struct pty_client *pclient)
+{
+    if (pty_on_this_thread(pclient))
+        lws_set_timeout(pclient->pty_wsi, PENDING_TIMEOUT_SHUTDOWN_FLUSH, LWS_TO_KILL_SYNC);
+    else {
+        pclient->close_requested = true;
+        wake_pty_thread(pclient);
+    }
+}
+
+static void unpause_pty(struct pty_client *pclient);
+
+/* Do the requests for a session in its own thread. */
+static void
+run_pty_requests(struct pty_client *pclient)
+{
+    if (pclient->unpause_requested) {
+        pclient->unpause_requested = false;
+        unpause_pty(pclient);
+    }
+    if (pclient->writable_requested) {
+        pclient->writable_requested = false;
+        lws_callback_on_writable(pclient->pty_wsi);
+    }
+    if (pclient->close_requested) {
+        // Not LWS_TO_KILL_SYNC, as we may be in a callback of pty_wsi.
+        pclient->close_requested = false;
+        lws_set_timeout(pclient->pty_wsi, PENDING_TIMEOUT_SHUTDOWN_FLUSH,
+                        LWS_TO_KILL_ASYNC);
+    }
+}
+
+#if USE_SERVICE_THREADS
+/* Do the requests of other threads for this thread's wsis.
+ * Called on LWS_CALLBACK_EVENT_WAIT_CANCELLED.
+ */
+void
+run_thread_requests(void)
+{
+    struct tty_client **p = &tty_requests;
+    while (*p != NULL) {
+        struct tty_client *tclient = *p;
+        if (tclient->tsi == service_tsi) {
+            *p = tclient->next_request;
+            char requests = tclient->requests;
+            tclient->requests = 0;
+            if ((requests & REQUEST_WRITABLE) != 0)
+                lws_callback_on_writable(tclient->wsi);
+            if ((requests & REQUEST_RESUME_INPUT) != 0)
+                resume_input(tclient);
+        } else
+            p = &tclient->next_request;
+    }
+    for (struct pty_client *pclient = pty_client_list;
+         pclient != NULL; pclient = pclient->next_pty_client) {
+        if (pclient->tsi == service_tsi)
+            run_pty_requests(pclient);
+    }
+}
+#endif
+
+/* Called at the start of callbacks for the pty_wsi. */
+static void
+note_pty_thread(struct pty_client *pclient)
+{
+    if (pclient->tsi != service_tsi) {
+        pclient->tsi = service_tsi;
+        run_pty_requests(pclient);
+    }
+}
+
+static void
+unpause_pty(struct pty_client *pclient)
+{
+    if (pclient->paused && ! pty_on_this_thread(pclient)) {
+        pclient->unpause_requested = true;
+        wake_pty_thread(pclient);
+        return;
+    }
+#if USE_PTY_THREADS
+    if (pclient->chunk != NULL) {
+        pclient->paused = 0;
+        ptyio_resume(pclient);
+        return;
+    }
+#endif
+    if (pclient->paused) {
+#if USE_RXFLOW
+        lws_rx_flow_control(pclient->pty_wsi,
+                            1|LWS_RXFLOW_REASON_FLAG_PROCESS_NOW);
+#endif
+        pclient->paused = 0;
+    }
+}
+
+/** Ask an up-to-date window for its contents (so a lagging window
+ * can be resynchronized), unless a request is already in progress.
+ * Returns false if there is no window to ask.
+ */
+static bool
+request_window_contents(struct pty_client *pclient)
+{
+    if (pclient->preserving)
+        return true;
+    struct tty_client *source = NULL;
+    struct lws *twsi;
+    FOREACH_WSCLIENT(twsi, pclient) {
+        struct tty_client *tclient = (struct tty_client *) lws_wsi_user(twsi);
+        if (tclient->requesting_contents > 0)
+            return true;
+        if (source == NULL && ! tclient->lagging && tclient->initialized)
+            source = tclient;
+    }
+    if (source == NULL)
+        return false;
+    source->requesting_contents = 1;
+    request_writable(source->wsi);
+    return true;
+}
+
+static int64_t
+monotonic_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+flow_reset(struct tty_client *tclient)
+{
+    tclient->window = main_options->window_floor;
+    tclient->rtt = 0;
+    tclient->min_rtt = 0;
+    tclient->min_rtt_time = 0;
+    tclient->delivery_rate = 0;
+    tclient->confirmed_time = 0;
+    tclient->nsamples = 0;
+}
+
+/** Remember when output up to the current sent_count was sent. */
+static void
+flow_note_sent(struct tty_client *tclient)
+{
+    int n = tclient->nsamples;
+    if (n == FLOW_SAMPLES
+        || (n > 0 && tclient->samples[n-1].count == tclient->sent_count))
+        return;
+    struct flow_sample *sample = &tclient->samples[n];
+    sample->count = tclient->sent_count;
+    sample->time = monotonic_usec();
+    sample->confirmed = tclient->confirmed_count;
+    // If everything sent before was already confirmed, the connection
+    // was idle, so don't count the idle time when measuring the rate.
+    sample->confirmed_time = n > 0 && tclient->confirmed_time != 0
+        ? tclient->confirmed_time : sample->time;
+    tclient->nsamples = n + 1;
+}
+
+/** Handle a RECEIVED count from the browser.
+ * Update the round-trip time and delivery rate from the matching samples,
+ * and set the window to (twice) the bandwidth-delay product.
+ */
+static void
+flow_note_received(struct tty_client *tclient, long count)
+{
+    int64_t now = monotonic_usec();
+    int i = 0;
+    while (i < tclient->nsamples
+           && ((count - tclient->samples[i].count) & MASK28) < (MASK28+1)/2)
+        i++;
+    if (i > 0) {
+        struct flow_sample *sample = &tclient->samples[i-1];
+        long rtt = now - sample->time;
+        tclient->rtt = tclient->rtt == 0 ? rtt : (7 * tclient->rtt + rtt) / 8;
+        if (tclient->min_rtt == 0 || rtt <= tclient->min_rtt
+            || now - tclient->min_rtt_time > MIN_RTT_LIFETIME) {
+            tclient->min_rtt = rtt;
+            tclient->min_rtt_time = now;
+        }
+        long delivered = (count - sample->confirmed) & MASK28;
+        int64_t interval = now - sample->confirmed_time;
+        if (interval > 0) {
+            double rate = delivered * 1e6 / interval;
+            double decayed = tclient->delivery_rate * 0.875;
+            tclient->delivery_rate = rate > decayed ? rate : decayed;
+        }
+        tclient->nsamples -= i;
+        memmove(tclient->samples, tclient->samples + i,
+                tclient->nsamples * sizeof(struct flow_sample));
+
+        long floor = main_options->window_floor;
+        long ceiling = main_options->window_ceiling;
+        double bdp = tclient->delivery_rate * tclient->min_rtt / 1e6;
+        long window = (long) (2 * bdp);
+        if (window > ceiling)
+            window = ceiling;
+        if (window < floor)
+            window = floor;
+        tclient->window = window;
+    }
+    tclient->confirmed_count = count;
+    tclient->confirmed_time = now;
+}
+
+static void
+advance_output(struct tty_client *tclient, size_t count)
+{
+    tclient->output_pos += count;
+    tclient->sent_count = (tclient->sent_count + count) & MASK28;
+}
+
+/* Write a span of a ring (with LWS_PRE headroom) as a websocket frame.
+ * The bytes before the span may belong to other data still in the ring,
+ * so we save and restore them around lws_write, which puts the frame
+ * header there. (lws copies anything it cannot send immediately.)
+ */
+static int
+write_output_span(struct lws *wsi, char *data, size_t length)
+{
+    unsigned char save[LWS_PRE];
+    unsigned char *p = (unsigned char *) data;
+    memcpy(save, p - LWS_PRE, LWS_PRE);
+    int n = lws_write(wsi, p, length, LWS_WRITE_BINARY);
+    memcpy(p - LWS_PRE, save, LWS_PRE);
+    return n;
+}
+
+/** Initialize a window from the spool alone (after resetting it),
+ * followed by any preserved output still in the output ring.
+ * If the oldest output was dropped, the replay starts at a line
+ * boundary, rather than in the middle of an escape sequence or
+ * character.  Returns the number of bytes of output replayed.
+ */
+static size_t
+replay_spool(struct tty_client *client, struct pty_client *pclient,
+             struct sbuf *buf)
+{
+    struct spool *spool = pclient->spool;
+    sbuf_printf(buf, "%s%s", resync_reset, start_replay_mode);
+    size_t start = buf->len;
+    spool_copy_out(spool, buf);
+    if (spool->dropped > 0) {
+        char *data = buf->buffer + start;
+        char *nl = memchr(data, '\n', buf->len - start);
+        if (nl != NULL) {
+            size_t skip = nl + 1 - data;
+            memmove(data, nl + 1, buf->len - start - skip);
+            buf->len -= skip;
+        }
+    }
+    if (pclient->preserving) {
+        long pstart = pclient->preserved_start;
+        if (client->output_pos < pstart)
+            client->output_pos = pstart;
+        size_t rlen = client->output_pos - pstart;
+        sbuf_extend(buf, rlen);
+        ring_copy_out(pclient->output, pstart, rlen, buf->buffer + buf->len);
+        buf->len += rlen;
+    }
+    size_t count = buf->len - start;
+    sbuf_printf(buf, "%s", end_replay_mode);
+    spool_clear(spool);
+    return count;
+}
+
+/** Write input to a session's pty, without blocking.
+ * What the pty doesn't take now is queued, and written when it is
+ * writable (see pty_drain_input).
+ */
+static void
+pty_writev(struct pty_client *pclient, struct iovec *iov, int iovcnt)
+{
+    struct sbuf *pending = &pclient->pending_input;
+    size_t length = 0;
+    for (int i = 0; i < iovcnt; i++)
+        length += iov[i].iov_len;
+    pclient->input_queued += length;
+    ssize_t n = 0;
+    if (pending->len == 0) {
+        n = writev(pclient->pty, iov, iovcnt);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            lwsl_err("write INPUT to pty: %s\n", strerror(errno));
+            n = length; // drop it
+        }
+        if (n < 0)
+            n = 0;
+        pclient->input_written += n;
+        if ((size_t) n < length)
+            request_pty_writable(pclient);
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        size_t skip = (size_t) n < iov[i].iov_len ? (size_t) n : iov[i].iov_len;
+        n -= skip;
+        if (skip < iov[i].iov_len)
+            sbuf_append(pending, (char *) iov[i].iov_base + skip,
+                        iov[i].iov_len - skip);
+    }
+}
+
+static void
+pty_write(struct pty_client *pclient, const char *data, size_t length)
+{
+    struct iovec iov;
+    iov.iov_base = (void *) data;
+    iov.iov_len = length;
+    pty_writev(pclient, &iov, 1);
+}
+
+/* Stop reading input from a window while too much input is queued. */
+static void
+check_input_limit(struct tty_client *tclient)
+{
+    struct pty_client *pclient = tclient->pclient;
+    long limit = main_options->input_limit;
+    if (pclient != NULL && limit > 0 && ! tclient->input_paused
+        && pclient->pending_input.len > (size_t) limit) {
+        tclient->input_paused = true;
+#if USE_RXFLOW
+        lws_rx_flow_control(tclient->wsi, 0);
+#endif
+    }
+}
+
+/* Tell a window how many chunks of its streamed paste were written. */
+static void
+paste_check_acks(struct tty_client *tclient)
+{
+    struct pty_client *pclient = tclient->pclient;
+    if (tclient->paste_id < 0 || pclient == NULL)
+        return;
+    int acked = tclient->paste_acked;
+    while (acked < tclient->paste_chunks
+           && tclient->paste_ends[acked % PASTE_WINDOW]
+              <= pclient->input_written)
+        acked++;
+    if (acked == tclient->paste_acked)
+        return;
+    tclient->paste_acked = acked;
+    printf_to_browser(tclient, URGENT_WRAP("\033[93;%d;%du"),
+                      tclient->paste_id, acked);
+    request_writable(tclient->wsi);
+    if (tclient->paste_ended && acked == tclient->paste_chunks)
+        tclient->paste_id = -1;
+}
+
+/* Handle progress writing (or discarding) pending input. */
+static void
+pty_input_written(struct pty_client *pclient)
+{
+    struct sbuf *pending = &pclient->pending_input;
+    if (pending->len > 0)
+        request_pty_writable(pclient);
+    else if (pending->size > 65536)
+        sbuf_free(pending);
+    long limit = main_options->input_limit;
+    struct lws *twsi;
+    FOREACH_WSCLIENT(twsi, pclient) {
+        struct tty_client *tclient = (struct tty_client *) lws_wsi_user(twsi);
+        paste_check_acks(tclient);
+        if (pending->len <= (size_t) limit / 2)
+            resume_input(tclient);
+    }
+}
+
+/* Write queued input, when the pty is writable. */
+static void
+pty_drain_input(struct pty_client *pclient)
+{
+    struct sbuf *pending = &pclient->pending_input;
+    if (pending->len > 0) {
+        ssize_t n = write(pclient->pty, pending->buffer, pending->len);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            lwsl_err("write INPUT to pty: %s\n", strerror(errno));
+            n = pending->len; // drop it
+        }
+        if (n > 0) {
+            pclient->input_written += n;
+            pending->len -= n;
+            memmove(pending->buffer, pending->buffer + n, pending->len);
+        }
+    }
+    pty_input_written(pclient);
+}
+
+/* Discard pending input, except for the first keep bytes. */
+static void
+discard_pending_input(struct pty_client *pclient, long keep)
+{
+    struct sbuf *pending = &pclient->pending_input;
+    if (keep < 0)
+        keep = 0;
+    if ((size_t) keep >= pending->len)
+        return;
+    pclient->input_written += pending->len - keep;
+    pending->len = keep;
+    pty_input_written(pclient);
+}
+
+/** Decay the recent input and output levels, and add new activity. */
+static void
+note_activity(struct pty_client *pclient, int input, long output)
+{
+    int64_t now = monotonic_usec();
+    double keep = (double) LEVEL_DECAY
+        / (LEVEL_DECAY + (now - pclient->level_time));
+    pclient->input_level = pclient->input_level * keep + input;
+    pclient->output_level = pclient->output_level * keep + output;
+    pclient->level_time = now;
+    if (input > 0)
+        pclient->input_time = now;
+}
+
+/** Microseconds to wait before sending new output to the windows.
+ * Pick the interactive profile if there was recent input (probably
+ * being echoed), or if output is not much more than input.
+ * Otherwise pick the bulk profile, so each frame carries more output.
+ */
+static long
+output_delay(struct pty_client *pclient)
+{
+    pclient->bulk_output =
+        pclient->output_level > BULK_RATIO * (pclient->input_level + 1)
+        && pclient->level_time - pclient->input_time > ECHO_TIME;
+    return 1000 * (pclient->bulk_output ? main_options->bulk_delay
+                   : main_options->interactive_delay);
+}
+
+static void
+flush_output(struct pty_client *pclient)
+{
+    pclient->flush_pending = false;
+    pclient->unflushed = 0;
+    struct lws *twsi;
+    FOREACH_WSCLIENT(twsi, pclient) {
+        request_writable(twsi);
+    }
+}
+
+/** Tell the windows about nread new bytes of output -
+ * now, or when the flush timer goes off (unless much more arrives).
+ */
+static void
+output_ready(struct pty_client *pclient, long nread)
+{
+    note_activity(pclient, 0, nread);
+    long delay = output_delay(pclient);
+    pclient->unflushed += nread;
+#if USE_LWS_TIMER
+    // (In flood mode the timer is used for frames.)
+    if (delay > 0 && pclient->unflushed < FLUSH_SIZE
+        && ! pclient->flooding) {
+        if (! pclient->flush_pending) {
+            pclient->flush_pending = true;
+            lws_set_timer_usecs(pclient->pty_wsi, delay);
+        }
+        return;
+    }
+#endif
+    flush_output(pclient);
+}
+
+/** The most room (window less unconfirmed and unsent output)
+ * of any live window of the session, or LONG_MIN if there is none.
+ */
+static long
+output_room(struct pty_client *pclient, int *live_clients)
+{
+    struct ring *output = pclient->output;
+    long max_room = LONG_MIN;
+    int live = 0;
+    struct lws *twsi;
+    FOREACH_WSCLIENT(twsi, pclient) {
+        struct tty_client *tclient = (struct tty_client *) lws_wsi_user(twsi);
+        if (tclient->lagging)
+            continue;
+        live++;
+        long unconfirmed =
+            ((tclient->sent_count - tclient->confirmed_count) & MASK28)
+            + (output->end - tclient->output_pos);
+        if (tclient->window - unconfirmed > max_room)
+            max_room = tclient->window - unconfirmed;
+    }
+    if (live_clients != NULL)
+        *live_clients = live;
+    return max_room;
+}
+
+#if USE_LWS_TIMER
+/** Append the screen changes since the previous frame to the output. */
+static void
+flood_frame(struct pty_client *pclient)
+{
+    struct sbuf frame;
+    sbuf_init(&frame);
+    screen_delta(pclient->screen, &frame);
+    if (frame.len > 0) {
+        ring_append(pclient->output, frame.buffer, frame.len);
+        struct lws *twsi;
+        FOREACH_WSCLIENT(twsi, pclient) {
+            request_writable(twsi);
+        }
+    }
+    sbuf_free(&frame);
+}
+
+/** Update the output rate of a session, given nread new bytes.
+ * Switch to flood mode after FLOOD_INTERVALS intervals faster than
+ * the flood-rate, and back once an interval is below half of it.
+ * Switching waits for the screen model to be between escape sequences,
+ * since the raw output stops (or resumes) at that point.
+ */
+static void
+flood_check(struct pty_client *pclient, long nread)
+{
+    long flood_rate = main_options->flood_rate;
+    if (pclient->screen == NULL || flood_rate <= 0)
+        return;
+    int64_t now = monotonic_usec();
+    pclient->rate_bytes += nread;
+    int64_t elapsed = now - pclient->rate_start;
+    if (elapsed >= FLOOD_INTERVAL) {
+        double rate = pclient->rate_bytes * 1e6 / elapsed;
+        pclient->rate_bytes = 0;
+        pclient->rate_start = now;
+        if (rate > flood_rate)
+            pclient->flood_intervals++;
+        else if (rate < flood_rate / 2 || ! pclient->flooding)
+            pclient->flood_intervals = 0;
+    }
+    if (! screen_idle(pclient->screen))
+        return;
+    // Flooding only starts when output is read (not on a timer),
+    // so no pty thread is reading into the output ring (see ptyio.c).
+    if (! pclient->flooding && pclient->flood_intervals >= FLOOD_INTERVALS
+        && nread > 0) {
+        lwsl_notice("session %d flooding - sending screen updates only\n",
+                    pclient->session_number);
+        pclient->flooding = true;
+        // Windows will get everything read so far as usual.
+        screen_delta_reset(pclient->screen);
+        if (pclient->flush_pending)
+            flush_output(pclient);
+        unpause_pty(pclient);
+        long frame_rate = main_options->frame_rate;
+        lws_set_timer_usecs(pclient->pty_wsi,
+                            1000000 / (frame_rate > 0 ? frame_rate : 1));
+    } else if (pclient->flooding && pclient->flood_intervals == 0) {
+        lwsl_notice("session %d no longer flooding\n",
+                    pclient->session_number);
+        pclient->flooding = false;
+        flood_frame(pclient);
+    }
+}
+#endif
+
 void
 maybe_exit()
 {
@@ -101,19 +818,214 @@ maybe_exit()
     }
 }
 
+// Session hash tables, indexed by SESSION_BY_PID etc.
+// Only sessions with a name are in the SESSION_BY_NAME index.
+static struct pty_client **session_index[SESSION_INDEXES];
+static unsigned session_index_size = 0; // a power of 2
+static unsigned session_index_count = 0;
+
+static unsigned
+session_name_hash(const char *name)
+{
+    unsigned h = 2166136261u; // FNV-1a
+    for (; *name; name++)
+        h = (h ^ (unsigned char) *name) * 16777619u;
+    return h;
+}
+
+static unsigned
+session_hash(struct pty_client *pclient, int which)
+{
+    unsigned h = which == SESSION_BY_PID ? (unsigned) pclient->pid
+        : which == SESSION_BY_NUMBER ? (unsigned) pclient->session_number
+        : session_name_hash(pclient->session_name);
+    return h & (session_index_size - 1);
+}
+
+static void
+session_index_link(struct pty_client *pclient, int which)
+{
+    struct pty_client **bucket =
+        &session_index[which][session_hash(pclient, which)];
+    pclient->index_next[which] = *bucket;
+    *bucket = pclient;
+}
+
+static void
+session_index_unlink(struct pty_client *pclient, int which)
+{
+    struct pty_client **p =
+        &session_index[which][session_hash(pclient, which)];
+    for (; *p != NULL; p = &(*p)->index_next[which]) {
+        if (*p == pclient) {
+            *p = pclient->index_next[which];
+            break;
+        }
+    }
+}
+
+/* Add a new session (with pid and session_number set) to the indexes. */
+static void
+session_index_add(struct pty_client *pclient)
+{
+    if (session_index_count >= session_index_size) {
+        // Grow (or create) the tables, and re-hash the existing sessions.
+        session_index_size = session_index_size ? 2 * session_index_size : 64;
+        for (int which = 0; which < SESSION_INDEXES; which++) {
+            free(session_index[which]);
+            session_index[which] =
+                xmalloc(session_index_size * sizeof(struct pty_client *));
+            memset(session_index[which], 0,
+                   session_index_size * sizeof(struct pty_client *));
+        }
+        for (struct pty_client *p = pty_client_list;
+             p != NULL; p = p->next_pty_client) {
+            if (p == pclient)
+                continue;
+            session_index_link(p, SESSION_BY_PID);
+            session_index_link(p, SESSION_BY_NUMBER);
+            if (p->session_name != NULL)
+                session_index_link(p, SESSION_BY_NAME);
+        }
+    }
+    session_index_count++;
+    session_index_link(pclient, SESSION_BY_PID);
+    session_index_link(pclient, SESSION_BY_NUMBER);
+    if (pclient->session_name != NULL)
+        session_index_link(pclient, SESSION_BY_NAME);
+}
+
+static void
+session_index_remove(struct pty_client *pclient)
+{
+    session_index_count--;
+    session_index_unlink(pclient, SESSION_BY_PID);
+    session_index_unlink(pclient, SESSION_BY_NUMBER);
+    if (pclient->session_name != NULL)
+        session_index_unlink(pclient, SESSION_BY_NAME);
+}
+
+static struct pty_client *
+find_session_by_pid(int pid)
+{
+    if (session_index_size == 0)
+        return NULL;
+    struct pty_client *p =
+        session_index[SESSION_BY_PID][pid & (session_index_size - 1)];
+    for (; p != NULL; p = p->index_next[SESSION_BY_PID]) {
+        if (p->pid == pid)
+            return p;
+    }
+    return NULL;
+}
+
+static struct pty_client *
+find_session_by_number(int number)
+{
+    if (session_index_size == 0)
+        return NULL;
+    struct pty_client *p =
+        session_index[SESSION_BY_NUMBER][number & (session_index_size - 1)];
+    for (; p != NULL; p = p->index_next[SESSION_BY_NUMBER]) {
+        if (p->session_number == number)
+            return p;
+    }
+    return NULL;
+}
+
+/* Find a session with the given name.
+ * Sets *count to the number of sessions with that name (at most 2).
+ */
+static struct pty_client *
+find_session_by_name(const char *name, int *count)
+{
+    struct pty_client *found = NULL;
+    *count = 0;
+    if (session_index_size == 0)
+        return NULL;
+    struct pty_client *p = session_index[SESSION_BY_NAME]
+        [session_name_hash(name) & (session_index_size - 1)];
+    for (; p != NULL && *count < 2; p = p->index_next[SESSION_BY_NAME]) {
+        if (strcmp(name, p->session_name) == 0) {
+            found = p;
+            (*count)++;
+        }
+    }
+    return found;
+}
+
+static void
+session_name_changed(struct pty_client *pclient)
+{
+    struct lws *twsi;
+    FOREACH_WSCLIENT(twsi, pclient) {
+        struct tty_client *t = (struct tty_client *) lws_wsi_user(twsi);
+        t->pty_window_update_needed = true;
+        request_writable(twsi);
+    }
+}
+
+/* Set (or change) the name of a session, updating uniqueness flags.
+ * Takes ownership of name, which may be NULL.
+ */
+static void
+set_session_name(struct pty_client *pclient, char *name)
+{
+    int count;
+    char *old_name = pclient->session_name;
+    if (old_name != NULL) {
+        session_index_unlink(pclient, SESSION_BY_NAME);
+        // A session that shared the old name may now be unique.
+        struct pty_client *other = find_session_by_name(old_name, &count);
+        if (count == 1 && ! other->session_name_unique) {
+            other->session_name_unique = true;
+            session_name_changed(other);
+        }
+        free(old_name);
+    }
+    pclient->session_name = name;
+    pclient->session_name_unique = name != NULL;
+    if (name == NULL)
+        return;
+    find_session_by_name(name, &count);
+    session_index_link(pclient, SESSION_BY_NAME);
+    if (count > 0) {
+        // Mark the other sessions with this name as not unique.
+        for (struct pty_client *p = pclient->index_next[SESSION_BY_NAME];
+             p != NULL; p = p->index_next[SESSION_BY_NAME]) {
+            if (p != pclient && strcmp(name, p->session_name) == 0
+                && p->session_name_unique) {
+                p->session_name_unique = false;
+                session_name_changed(p);
+            }
+        }
+        pclient->session_name_unique = false;
+        session_name_changed(pclient);
+    }
+}
+
+static void shell_pool_unlink(struct pty_client *pclient);
+
 void
 pty_destroy(struct pty_client *pclient)
 {
-    struct pty_client **p = &pty_client_list;
-    struct pty_client *prev = NULL;
-    for (;*p != NULL; p = &(*p)->next_pty_client) {
-      if (*p == pclient) {
-        *p = pclient->next_pty_client;
-        if (pty_client_last == pclient)
-          pty_client_last = prev;
-        break;
-      }
-      prev = *p;
+    bool idle = pclient->pool != NULL;
+    if (idle) {
+        // An idle shell (see run_command) exited or was retired.
+        shell_pool_unlink(pclient);
+    } else {
+        if (pclient->prev_pty_client == NULL)
+            pty_client_list = pclient->next_pty_client;
+        else
+            pclient->prev_pty_client->next_pty_client =
+                pclient->next_pty_client;
+        if (pclient->next_pty_client == NULL)
+            pty_client_last = pclient->prev_pty_client;
+        else
+            pclient->next_pty_client->prev_pty_client =
+                pclient->prev_pty_client;
+        set_session_name(pclient, NULL);
+        session_index_remove(pclient);
     }
 
     // stop event loop
@@ -126,21 +1038,19 @@ pty_destroy(struct pty_client *pclient)
         free(pclient->saved_window_contents);
         pclient->saved_window_contents = NULL;
     }
-    if (pclient->preserved_output != NULL) {
-        free(pclient->preserved_output);
-        pclient->preserved_output = NULL;
+    ring_unref(pclient->output);
+    pclient->output = NULL;
+    spool_free(pclient->spool);
+    pclient->spool = NULL;
+    sbuf_free(&pclient->pending_input);
+#if USE_PTY_THREADS
+    ptyio_remove(pclient);
+#endif
+    if (pclient->screen != NULL) {
+        screen_free(pclient->screen);
+        pclient->screen = NULL;
     }
 
-    // kill process and free resource
-    lwsl_notice("sending %d to process %d\n",
-                server->options.sig_code, pclient->pid);
-    if (kill(pclient->pid, server->options.sig_code) != 0) {
-        lwsl_err("kill: pid: %d, errno: %d (%s)\n", pclient->pid, errno, strerror(errno));
-    }
-    int status;
-    while (waitpid(pclient->pid, &status, 0) == -1 && errno == EINTR)
-        ;
-    lwsl_notice("process exited with code %d, pid: %d\n", status, pclient->pid);
     close(pclient->pty);
 #ifndef LWS_TO_KILL_SYNC
 #define LWS_TO_KILL_SYNC (-1)
@@ -148,8 +1058,10 @@ pty_destroy(struct pty_client *pclient)
     // FIXME free client; set pclient to NULL in all matching tty_clients.
 
     // remove from sessions list
-    server->session_count--;
-    maybe_exit();
+    if (! idle) {
+        server->session_count--;
+        maybe_exit();
+    }
 }
 
 void
@@ -161,9 +1073,49 @@ printf_to_browser(struct tty_client *tclient, const char *format, ...)
     va_end(ap);
 }
 
+// Windows of closed sessions waiting for the exit status of the
+// session's process, before sending the end-of-session message.
+static struct tty_client *exit_waiters = NULL;
+
+/** Called (by the reaper) when the process of a closed session exits.
+ * The status is its wait status, or -1 if unknown.
+ */
+void
+process_exited(pid_t pid, int status)
+{
+    struct tty_client **p = &exit_waiters;
+    while (*p != NULL) {
+        struct tty_client *tclient = *p;
+        if (tclient->waiting_pid == pid) {
+            *p = tclient->next_exit_waiter;
+            tclient->waiting_pid = 0;
+            tclient->exit_status = status < 0 ? -1 : exit_code(status);
+            request_writable(tclient->wsi);
+        } else
+            p = &tclient->next_exit_waiter;
+    }
+}
+
 void
 tty_client_destroy(struct lws *wsi, struct tty_client *tclient) {
+    if (tclient->requests != 0) {
+        struct tty_client **p = &tty_requests;
+        while (*p != tclient)
+            p = &(*p)->next_request;
+        *p = tclient->next_request;
+        tclient->requests = 0;
+    }
+    if (tclient->waiting_pid != 0) {
+        struct tty_client **p = &exit_waiters;
+        while (*p != tclient)
+            p = &(*p)->next_exit_waiter;
+        *p = tclient->next_exit_waiter;
+        tclient->waiting_pid = 0;
+    }
     sbuf_free(&tclient->ob);
+    sbuf_free(&tclient->wb);
+    ring_unref(tclient->output);
+    tclient->output = NULL;
 
     // remove from clients list
     server->client_count--;
@@ -186,12 +1138,16 @@ tty_client_destroy(struct lws *wsi, struct tty_client *tclient) {
       }
       pwsi = nwsi;
     }
+    trim_output(pclient);
+    // A detached session keeps running.
+    if (should_drain(pclient))
+        unpause_pty(pclient);
     // FIXME reclaim memory cleanup for tclient
     struct lws *first_twsi = pclient->first_client_wsi;
     if (tclient->detach_on_close) {
         pclient->detach_count++;
     } else if (first_twsi == NULL && pclient->detach_count == 0) {
-        lws_set_timeout(pclient->pty_wsi, PENDING_TIMEOUT_SHUTDOWN_FLUSH, LWS_TO_KILL_SYNC);
+        close_pty(pclient);
     }
     // If only one client left, do detachSaveSend
     if (first_twsi != NULL) {
@@ -214,6 +1170,8 @@ setWindowSize(struct pty_client *client)
     ws.ws_ypixel = (int) client->pixh;
     if (ioctl(client->pty, TIOCSWINSZ, &ws) < 0)
         lwsl_err("ioctl TIOCSWINSZ: %d (%s)\n", errno, strerror(errno));
+    if (client->screen != NULL)
+        screen_resize(client->screen, client->nrows, client->ncols);
 }
 
 void link_command(struct lws *wsi, struct tty_client *tclient,
@@ -222,6 +1180,8 @@ void link_command(struct lws *wsi, struct tty_client *tclient,
     tclient->pclient = pclient;
     struct lws *first_twsi = pclient->first_client_wsi;
     tclient->next_client_wsi = NULL;
+    tclient->output = ring_ref(pclient->output);
+    tclient->output_pos = pclient->output->end;
 
     if (first_twsi != NULL) {
         struct tty_client *first_tclient = lws_wsi_user(first_twsi);
@@ -247,9 +1207,9 @@ void link_command(struct lws *wsi, struct tty_client *tclient,
             first_tclient->pty_window_update_needed = true;
             // these was exctly one other tclient
             tclient->detachSaveSend = true;
-            lws_callback_on_writable(wsi);
+            request_writable(wsi);
             first_tclient->detachSaveSend = true;
-            lws_callback_on_writable(first_twsi);
+            request_writable(first_twsi);
         }
     } else if (pclient->detachOnClose) // FIXME
         tclient->detachSaveSend = true;
@@ -262,13 +1222,7 @@ void link_command(struct lws *wsi, struct tty_client *tclient,
     pclient->detached = 0;
     if (pclient->detach_count > 0)
         pclient->detach_count--;
-    if (pclient->paused) {
-#if USE_RXFLOW
-        lws_rx_flow_control(pclient->pty_wsi,
-                            1|LWS_RXFLOW_REASON_FLAG_PROCESS_NOW);
-#endif
-        pclient->paused = 0;
-    }
+    unpause_pty(pclient);
 }
 
 void put_to_env_array(char **arr, int max, char* eval)
@@ -289,12 +1243,134 @@ void put_to_env_array(char **arr, int max, char* eval)
     }
 }
 
+/* Write pid in decimal, followed by a NUL.
+ * Only this is done in the child after vfork (see run_command).
+ */
+static void
+format_pid(char *buf, pid_t pid)
+{
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = '0' + pid % 10;
+        pid /= 10;
+    } while (pid > 0);
+    while (n > 0)
+        *buf++ = digits[--n];
+    *buf = '\0';
+}
+
+/** The environment of a new session.
+ * This is built before the child process is started.  The child's
+ * pid is not known yet, so the child writes it at pid_slot.
+ */
+struct spawn_env {
+    char **envp;
+    char *domterm; // the DOMTERM variable, or NULL
+    char *pid_slot; // in domterm, or NULL
+    char *preload; // the LD_PRELOAD variable, or NULL
+};
+
+static void
+spawn_env_init(struct spawn_env *senv, char **env, int session_number,
+               const char *ttyName)
+{
+    int env_size = 0;
+    while (env[env_size] != NULL) env_size++;
+    int env_max = env_size + 10;
+    char **nenv = xmalloc((env_max + 1)*sizeof(const char*));
+    memcpy(nenv, env, (env_size + 1)*sizeof(const char*));
+    senv->envp = nenv;
+    senv->domterm = NULL;
+    senv->pid_slot = NULL;
+    senv->preload = NULL;
+
+    put_to_env_array(nenv, env_max, "TERM=xterm-256color");
+#if !  WITH_XTERMJS
+    put_to_env_array(nenv, env_max, "COLORTERM=truecolor");
+#ifdef LWS_LIBRARY_VERSION
+#define SHOW_LWS_LIBRARY_VERSION "=" LWS_LIBRARY_VERSION
+#else
+#define SHOW_LWS_LIBRARY_VERSION ""
+#endif
+    const char *version_info =
+        /* FIXME   tclient != NULL ? tclient->version_info
+           :*/ "version=" LDOMTERM_VERSION;
+    struct sbuf sb;
+    sbuf_init(&sb);
+    sbuf_printf(&sb, "DOMTERM=%s;libwebsockets" SHOW_LWS_LIBRARY_VERSION,
+                version_info);
+    if (ttyName != NULL && ttyName[0])
+        sbuf_printf(&sb, ";tty=%s", ttyName);
+    if (session_number > 0)
+        sbuf_printf(&sb, ";session#=%d", session_number);
+    sbuf_printf(&sb, ";pid=");
+    size_t pid_offset = sb.len;
+    sbuf_blank(&sb, 24); // room for the pid (and the NUL)
+    senv->domterm = sb.buffer;
+    senv->pid_slot = sb.buffer + pid_offset;
+    senv->pid_slot[0] = '\0';
+    put_to_env_array(nenv, env_max, senv->domterm);
+#endif
+#if ENABLE_LD_PRELOAD
+    int normal_user = getuid() == geteuid();
+    char* domterm_home = get_bin_relative_path("");
+    if (normal_user && domterm_home != NULL) {
+#if __APPLE__
+        char *fmt =  "DYLD_INSERT_LIBRARIES=%s/lib/domterm-preloads.dylib";
+#else
+        char *fmt =  "LD_PRELOAD=%s/lib/domterm-preloads.so libdl.so.2";
+#endif
+        char *buf = xmalloc(strlen(domterm_home)+strlen(fmt)-1);
+        sprintf(buf, fmt, domterm_home);
+        senv->preload = buf;
+        put_to_env_array(nenv, env_max, buf);
+    }
+#endif
+}
+
+static void
+spawn_env_free(struct spawn_env *senv)
+{
+    free(senv->envp);
+    free(senv->domterm);
+    free(senv->preload);
+}
+
+// The pty being adopted by this thread (see spawn_pty).
+static __thread struct pty_client *adopting_pty = NULL;
+
+/* Finish initializing a new pty, from the adopt callback. */
+static void
+pty_adopted(struct lws *wsi, struct pty_client *pclient,
+            struct pty_client *init)
+{
+    *pclient = *init;
+    pclient->last_client_wsi_ptr = &pclient->first_client_wsi;
+    pclient->pty_wsi = wsi;
+#if USE_SERVICE_THREADS
+    // This may be another thread than the one that will serve wsi.
+    pclient->tsi = lws_get_tsi(wsi);
+#else
+    pclient->tsi = 0;
+#endif
+#if USE_PTY_THREADS
+    pclient->chunk = NULL;
+    // A pty thread reads instead of the service thread.
+    if (ptyio_add(pclient))
+        lws_rx_flow_control(wsi, 0);
+#endif
+}
+
+/* Start a command in a new pty.
+ * The result is not yet a session (see add_session).
+ * If session_number is 0, DOMTERM does not include it.
+ */
 static struct pty_client *
-run_command(const char *cmd, char*const*argv, const char*cwd,
-            char **env, struct options *opts)
+spawn_pty(const char *cmd, char*const*argv, const char*cwd,
+          char **env, const char *tty_packet_mode, int session_number)
 {
     struct lws *outwsi;
-    int session_number = ++last_session_number;
 
     int master;
     int slave;
@@ -305,15 +1381,15 @@ run_command(const char *cmd, char*const*argv, const char*cwd,
         return NULL;
     }
 #if USE_PTY_PACKET_MODE
-    if (! (opts->tty_packet_mode
-           && strcmp(opts->tty_packet_mode, "no") == 0)) {
+    if (! (tty_packet_mode
+           && strcmp(tty_packet_mode, "no") == 0)) {
         int nonzero = 1;
         packet_mode = ioctl(master, TIOCPKT, &nonzero) == 0;
     }
 #if EXTPROC
     if (packet_mode
-        && (opts->tty_packet_mode == NULL
-            || strcmp(opts->tty_packet_mode, "extproc") == 0)) {
+        && (tty_packet_mode == NULL
+            || strcmp(tty_packet_mode, "extproc") == 0)) {
         struct termios tio;
         tcgetattr(slave, &tio);
         tio.c_lflag |= EXTPROC;
@@ -322,136 +1398,107 @@ run_command(const char *cmd, char*const*argv, const char*cwd,
 #endif
 #endif
 
-            pid_t pid = fork();
+    char *tname = strdup(ttyname(slave));
+    const char *home = find_home();
+    struct spawn_env senv;
+    spawn_env_init(&senv, env, session_number, tname);
+    // Block signals until the child has reset their handlers.
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+    // The child shares our memory (and stack) until it calls execve,
+    // so it must only make async-signal-safe calls, and not allocate.
+    pid_t pid = vfork();
     switch (pid) {
     case -1: /* error */
-            lwsl_err("forkpty\n");
+            pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+            lwsl_err("vfork\n");
             close(master);
             close(slave);
+            free(tname);
+            spawn_env_free(&senv);
             break;
     case 0: /* child */
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            signal(SIGCHLD, SIG_DFL);
+            sigprocmask(SIG_SETMASK, &old_signals, NULL);
             close(master);
             if (login_tty(slave))
                 _exit(1);
             if (cwd == NULL || chdir(cwd) != 0) {
-                const char *home = find_home();
                 if (home == NULL || chdir(home) != 0)
                     if (chdir("/") != 0)
-                        lwsl_err("chdir failed\n");
-            }
-            int env_size = 0;
-            while (env[env_size] != NULL) env_size++;
-            int env_max = env_size + 10;
-            char **nenv = xmalloc((env_max + 1)*sizeof(const char*));
-            memcpy(nenv, env, (env_size + 1)*sizeof(const char*));
-
-            put_to_env_array(nenv, env_max, "TERM=xterm-256color");
-#if !  WITH_XTERMJS
-            put_to_env_array(nenv, env_max, "COLORTERM=truecolor");
-            char* dinit = "DOMTERM=";
-#ifdef LWS_LIBRARY_VERSION
-#define SHOW_LWS_LIBRARY_VERSION "=" LWS_LIBRARY_VERSION
-#else
-#define SHOW_LWS_LIBRARY_VERSION ""
-#endif
-            const char *lstr = ";libwebsockets" SHOW_LWS_LIBRARY_VERSION;
-            char* pinit = ";tty=";
-            char* ttyName = ttyname(0);
-            char pidbuf[40];
-            pid = getpid();
-            size_t dlen = strlen(dinit);
-            size_t llen = strlen(lstr);
-            size_t plen = strlen(pinit);
-            int tlen = ttyName == NULL ? 0 : strlen(ttyName);
-            char *version_info =
-              /* FIXME   tclient != NULL ? tclient->version_info
-                    :*/ "version=" LDOMTERM_VERSION;
-            int vlen = version_info == NULL ? 0 : strlen(version_info);
-            int mlen = dlen + vlen + llen + (tlen > 0 ? plen + tlen : 0);
-            if (pid > 0) {
-                sprintf(pidbuf, ";session#=%d;pid=%d", session_number, pid);
-                mlen += strlen(pidbuf);
+                        _exit(1);
             }
-            char* ebuf = malloc(mlen+1);
-            strcpy(ebuf, dinit);
-            int offset = dlen;
-            if (version_info)
-                strcpy(ebuf+offset, version_info);
-            offset += vlen;
-            strcpy(ebuf+offset, lstr);
-            offset += llen;
-            if (tlen > 0) {
-                strcpy(ebuf+offset, pinit);
-                offset += plen;
-                strcpy(ebuf+offset, ttyName);
-                offset += tlen;
-            }
-            if (pid > 0) {
-                strcpy(ebuf+offset, pidbuf);
-                offset += strlen(pidbuf);
-            }
-            ebuf[mlen] = '\0';
-            put_to_env_array(nenv, env_max, ebuf);
-#endif
-#if ENABLE_LD_PRELOAD
-            int normal_user = getuid() == geteuid();
-            char* domterm_home = get_bin_relative_path("");
-            if (normal_user && domterm_home != NULL) {
-#if __APPLE__
-                char *fmt =  "DYLD_INSERT_LIBRARIES=%s/lib/domterm-preloads.dylib";
-#else
-                char *fmt =  "LD_PRELOAD=%s/lib/domterm-preloads.so libdl.so.2";
-#endif
-                char *buf = malloc(strlen(domterm_home)+strlen(fmt)-1);
-                sprintf(buf, fmt, domterm_home);
-                put_to_env_array(nenv, env_max, buf);
-            }
-#endif
-            if (execve(cmd, argv, nenv) < 0) {
-                perror("execvp");
-                exit(1);
-            }
-            break;
+            if (senv.pid_slot != NULL)
+                format_pid(senv.pid_slot, getpid());
+            execve(cmd, argv, senv.envp);
+            static const char emsg[] = "domterm: cannot execute command\n";
+            if (write(2, emsg, sizeof(emsg)-1) < 0)
+                _exit(2);
+            _exit(1);
         default: /* parent */
+            pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+            spawn_env_free(&senv);
             lwsl_notice("started process, pid: %d\n", pid);
-            char *tname = strdup(ttyname(slave));
             close(slave);
+            // The new pclient is initialized (from init) by the adopt
+            // callback, before other service threads can see it.
+            struct pty_client init;
+            memset(&init, 0, sizeof(init));
+            init.ttyname = tname;
+            init.packet_mode = packet_mode;
+            init.termios_valid = false;
+            init.pool = NULL;
+            init.pid = pid;
+            init.pty = master;
+            init.nrows = -1;
+            init.ncols = -1;
+            init.pixh = -1;
+            init.pixw = -1;
+            init.eof_seen = 0;
+            init.detachOnClose = 0;
+            init.detach_count = 0;
+            init.detached = 0;
+            init.paused = 0;
+            init.saved_window_contents = NULL;
+            init.output = ring_new(LWS_PRE);
+            init.screen = main_options->screen_model
+                ? screen_new(24, 80, main_options->screen_scrollback)
+                : NULL;
+            init.preserving = false;
+            init.spool = NULL;
+            init.first_client_wsi = NULL;
+            init.recent_tclient = NULL;
+            init.tsi = -1;
+            init.unpause_requested = false;
+            init.close_requested = false;
+            init.writable_requested = false;
+            sbuf_init(&init.pending_input);
+            init.input_queued = 0;
+            init.input_written = 0;
+            setblocking(master, 0);
             lws_sock_file_fd_type fd;
             fd.filefd = master;
-            //if (tclient == NULL)              return NULL;
+            // Adopting may take the lock of another service thread,
+            // which may be waiting for ours.
+            adopting_pty = &init;
+            int depth = service_unlock_all();
             outwsi = lws_adopt_descriptor_vhost(vhost, 0, fd, "pty", NULL);
+            service_relock(depth);
+            adopting_pty = NULL;
+            if (outwsi == NULL) {
+                lwsl_err("cannot adopt pty\n");
+                close(master);
+                ring_unref(init.output);
+                if (init.screen != NULL)
+                    screen_free(init.screen);
+                free(tname);
+                end_process(pid, SIGHUP);
+                return NULL;
+            }
             struct pty_client *pclient = (struct pty_client *) lws_wsi_user(outwsi);
-            pclient->ttyname = tname;
-            pclient->packet_mode = packet_mode;
-            pclient->next_pty_client = NULL;
-            server->session_count++;
-            if (pty_client_last == NULL)
-              pty_client_list = pclient;
-            else
-              pty_client_last->next_pty_client = pclient;
-            pty_client_last = pclient;
-
-            pclient->pid = pid;
-            pclient->pty = master;
-            pclient->nrows = -1;
-            pclient->ncols = -1;
-            pclient->pixh = -1;
-            pclient->pixw = -1;
-            pclient->eof_seen = 0;
-            pclient->detachOnClose = 0;
-            pclient->detach_count = 0;
-            pclient->detached = 0;
-            pclient->paused = 0;
-            pclient->saved_window_contents = NULL;
-            pclient->preserved_output = NULL;
-            pclient->first_client_wsi = NULL;
-            pclient->last_client_wsi_ptr = &pclient->first_client_wsi;
-            pclient->recent_tclient = NULL;
-            if (pclient->nrows >= 0)
-               setWindowSize(pclient);
-            pclient->session_number = session_number;
-            pclient->session_name_unique = false;
-            pclient->pty_wsi = outwsi;
             // lws_change_pollfd ??
             // FIXME do on end: tty_client_destroy(client);
             return pclient;
@@ -460,34 +1507,287 @@ run_command(const char *cmd, char*const*argv, const char*cwd,
     return NULL;
 }
 
+/* Make a new pty a session. */
+static void
+add_session(struct pty_client *pclient, int session_number)
+{
+    pclient->next_pty_client = NULL;
+    pclient->prev_pty_client = pty_client_last;
+    server->session_count++;
+    if (pty_client_last == NULL)
+        pty_client_list = pclient;
+    else
+        pty_client_last->next_pty_client = pclient;
+    pty_client_last = pclient;
+    pclient->session_number = session_number;
+    pclient->session_name_unique = false;
+    session_index_add(pclient);
+}
+
+/** A pool of idle shells (see the session.warm-pool setting).
+ * The shells were started with the same command, directory, options
+ * and environment (from the request that created the pool), and are
+ * not (yet) sessions.
+ */
+struct shell_pool {
+    struct shell_pool *next;
+    struct sbuf key; // the arguments of run_command, see find_shell_pool
+    char *cmd;
+    char **argv;
+    char *cwd;
+    char **env;
+    char *tty_packet_mode;
+    struct pty_client *idle; // linked by next_pty_client
+    int nidle;
+};
+
+// Pools of the most recently used commands; the rest are dropped.
+#define MAX_SHELL_POOLS 8
+static struct shell_pool *shell_pools = NULL;
+// Shells that were dropped from their pool, but have not exited yet.
+static struct shell_pool retired_shells;
+static bool shell_pools_refill_needed = false;
+static void request_shell_pools_refill(void);
+
+static char **
+copy_string_array(char *const*strings)
+{
+    int n = 0;
+    while (strings[n] != NULL)
+        n++;
+    char **copy = xmalloc((n + 1) * sizeof(char*));
+    for (int i = 0; i < n; i++)
+        copy[i] = strdup(strings[i]);
+    copy[n] = NULL;
+    return copy;
+}
+
+static void
+free_string_array(char **strings)
+{
+    for (char **p = strings; *p != NULL; p++)
+        free(*p);
+    free(strings);
+}
+
+static void
+append_pool_key(struct sbuf *key, const char *str)
+{
+    if (str == NULL)
+        sbuf_append(key, "\1", 2); // distinct from any string
+    else
+        sbuf_append(key, str, strlen(str) + 1);
+}
+
+/* Remove an idle shell from its pool. */
+static void
+shell_pool_unlink(struct pty_client *pclient)
+{
+    struct shell_pool *pool = pclient->pool;
+    struct pty_client **p = &pool->idle;
+    while (*p != pclient)
+        p = &(*p)->next_pty_client;
+    *p = pclient->next_pty_client;
+    pool->nidle--;
+    pclient->pool = NULL;
+}
+
+/* Stop an idle shell; pty_destroy finishes when it exits. */
+static void
+retire_shell(struct pty_client *pclient)
+{
+    shell_pool_unlink(pclient);
+    pclient->pool = &retired_shells;
+    pclient->next_pty_client = retired_shells.idle;
+    retired_shells.idle = pclient;
+    retired_shells.nidle++;
+    kill(pclient->pid, SIGHUP);
+}
+
+static void
+free_shell_pool(struct shell_pool *pool)
+{
+    while (pool->idle != NULL)
+        retire_shell(pool->idle);
+    sbuf_free(&pool->key);
+    free(pool->cmd);
+    free_string_array(pool->argv);
+    free(pool->cwd);
+    free_string_array(pool->env);
+    free(pool->tty_packet_mode);
+    free(pool);
+}
+
+// The environment variables that must match for a pooled shell to be
+// used (see session.warm-pool).
+static const char *shell_pool_env_keys[] = {
+    "PATH", "HOME", "USER", "LOGNAME", "SHELL", "TERM",
+    "LANG", "LC_ALL", "LC_CTYPE", "TZ",
+    "DISPLAY", "WAYLAND_DISPLAY", "XDG_RUNTIME_DIR", "SSH_AUTH_SOCK",
+    NULL
+};
+
+/* Find (or create) the pool for the arguments of run_command.
+ * The pool is moved to the front of the (most recently used) list.
+ */
+static struct shell_pool *
+find_shell_pool(const char *cmd, char*const*argv, const char*cwd,
+                char **env, struct options *opts)
+{
+    struct sbuf key;
+    sbuf_init(&key);
+    append_pool_key(&key, cmd);
+    int argc = 0;
+    while (argv[argc] != NULL)
+        argc++;
+    sbuf_printf(&key, "%d", argc);
+    for (int i = 0; i < argc; i++)
+        append_pool_key(&key, argv[i]);
+    append_pool_key(&key, cwd);
+    append_pool_key(&key, opts->tty_packet_mode);
+    // Other variables (such as PWD, SHLVL or _) differ between most
+    // requests; a pooled shell has those of the request that made its pool.
+    for (const char **name = shell_pool_env_keys; *name != NULL; name++)
+        append_pool_key(&key, getenv_from_array((char *) *name, env));
+
+    struct shell_pool **p = &shell_pools;
+    int npools = 0;
+    for (; *p != NULL; p = &(*p)->next, npools++) {
+        struct shell_pool *pool = *p;
+        if (pool->key.len == key.len
+            && memcmp(pool->key.buffer, key.buffer, key.len) == 0) {
+            sbuf_free(&key);
+            *p = pool->next;
+            pool->next = shell_pools;
+            shell_pools = pool;
+            return pool;
+        }
+    }
+    if (npools >= MAX_SHELL_POOLS) {
+        // Drop the least recently used pool.
+        p = &shell_pools;
+        while ((*p)->next != NULL)
+            p = &(*p)->next;
+        free_shell_pool(*p);
+        *p = NULL;
+    }
+    struct shell_pool *pool = xmalloc(sizeof(struct shell_pool));
+    pool->key = key;
+    pool->cmd = strdup(cmd);
+    pool->argv = copy_string_array(argv);
+    pool->cwd = cwd == NULL ? NULL : strdup(cwd);
+    pool->env = copy_string_array(env);
+    pool->tty_packet_mode = opts->tty_packet_mode == NULL ? NULL
+        : strdup(opts->tty_packet_mode);
+    pool->idle = NULL;
+    pool->nidle = 0;
+    pool->next = shell_pools;
+    shell_pools = pool;
+    return pool;
+}
+
+/* Start a shell for a pool that has fewer than session.warm-pool idle
+ * shells, if refilling was requested.  Called from the main loop
+ * (between lws_service calls), so starting shells does not delay
+ * the request that used one; just one is started per call.
+ */
+void
+refill_shell_pools(void)
+{
+    if (! shell_pools_refill_needed)
+        return;
+    shell_pools_refill_needed = false;
+    long wanted = main_options->warm_pool;
+    struct shell_pool *pool;
+    for (pool = shell_pools; pool != NULL; pool = pool->next) {
+        while (pool->nidle > wanted)
+            retire_shell(pool->idle);
+    }
+    for (pool = shell_pools; pool != NULL; pool = pool->next) {
+        if (pool->nidle < wanted)
+            break;
+    }
+    if (pool == NULL)
+        return;
+    struct pty_client *pclient =
+        spawn_pty(pool->cmd, pool->argv, pool->cwd, pool->env,
+                  pool->tty_packet_mode, 0);
+    if (pclient == NULL)
+        return; // don't retry until the next request
+    // The service lock was released while starting the shell,
+    // so the pool may have been dropped.
+    struct shell_pool *p = shell_pools;
+    while (p != NULL && p != pool)
+        p = p->next;
+    if (p == NULL)
+        pool = &retired_shells;
+    pclient->pool = pool;
+    pclient->next_pty_client = pool->idle;
+    pool->idle = pclient;
+    pool->nidle++;
+    if (pool == &retired_shells)
+        kill(pclient->pid, SIGHUP);
+    request_shell_pools_refill(); // check for more on the next call
+}
+
+/* Refill the pools soon, after the current request is handled. */
+static void
+request_shell_pools_refill(void)
+{
+    if (! shell_pools_refill_needed) {
+        shell_pools_refill_needed = true;
+        lws_cancel_service(context); // have the main loop run now
+    }
+}
+
+/* Start a new session, using an idle shell if there is a suitable one. */
+static struct pty_client *
+run_command(const char *cmd, char*const*argv, const char*cwd,
+            char **env, struct options *opts)
+{
+    int session_number = ++last_session_number;
+    struct shell_pool *pool = main_options->warm_pool <= 0 ? NULL
+        : find_shell_pool(cmd, argv, cwd, env, opts);
+    struct pty_client *pclient = NULL;
+    if (pool != NULL && pool->idle != NULL) {
+        // Its DOMTERM has no session# (it was started before the
+        // number was known); commands find the session by its pid.
+        pclient = pool->idle;
+        shell_pool_unlink(pclient);
+        lwsl_notice("using idle process, pid: %d\n", pclient->pid);
+    } else
+        pclient = spawn_pty(cmd, argv, cwd, env, opts->tty_packet_mode,
+                            session_number);
+    if (pclient != NULL)
+        add_session(pclient, session_number);
+    else if (last_session_number == session_number)
+        last_session_number--; // not used after all
+    if (pool != NULL)
+        request_shell_pools_refill();
+    return pclient;
+}
+
 struct pty_client *
 find_session(const char *specifier)
 {
-    struct pty_client *session = NULL;
-    struct pty_client *pclient = pty_client_list;
     char *pend;
     pid_t pid = strtol(specifier, &pend, 10);
-    if (*pend != '\0' || *specifier == '\0')
-        pid = -1;
-
-    for (; pclient != NULL; pclient = pclient->next_pty_client) {
-        int match = 0;
-        if (pclient->pid == pid && pid != -1)
+    if (*pend == '\0' && *specifier != '\0') {
+        struct pty_client *pclient = find_session_by_pid(pid);
+        if (pclient != NULL)
             return pclient;
-        if (pclient->session_name != NULL
-            && strcmp(specifier, pclient->session_name) == 0)
-            match = 1;
-        else if (specifier[0] == ':'
-                 && strtol(specifier+1, NULL, 10) == pclient->session_number)
-          match = 1;
-        if (match) {
-          if (session != NULL)
-            return NULL; // ambiguous
-          else
+    }
+    int count;
+    struct pty_client *session = find_session_by_name(specifier, &count);
+    if (specifier[0] == ':') {
+        struct pty_client *pclient =
+            find_session_by_number(strtol(specifier+1, NULL, 10));
+        if (pclient != NULL && pclient != session) {
             session = pclient;
+            count++;
         }
     }
-    return session;
+    return count == 1 ? session : NULL; // NULL if none or ambiguous
 }
 
 static char localhost_localdomain[] = "localhost.localdomain";
@@ -703,222 +2003,450 @@ handle_tlink(char *template, json_object *obj)
     return r;
 }
 
-void
-handle_link(json_object *obj)
+void
+handle_link(json_object *obj)
+{
+    if (json_object_object_get_ex(obj, "filename", NULL)) {
+        char *template = main_options->openfile_application;
+        if (template == NULL)
+            template =
+              "{in-atom}{with-position|!.html}atom;"
+              "{with-position|!.html}emacsclient;"
+              "{with-position|!.html}emacs;"
+              "{with-position|!.html}atom";
+        if (handle_tlink(template, obj))
+            return;
+    }
+    char *template = main_options->openlink_application;
+    if (template == NULL)
+        template = "{!mailto:}browser;{!mailto:}chrome;{!mailto:}firefox";
+    handle_tlink(template, obj);
+}
+
+/** The terminal modes of a session's pty, or NULL if unknown.
+ * The modes are cached until they may have changed.
+ */
+struct termios *
+pty_termios(struct pty_client *pclient)
+{
+    if (! pclient->termios_valid) {
+        if (tcgetattr(pclient->pty, &pclient->termios) != 0)
+            return NULL;
+        pclient->termios_valid = true;
+    }
+    return &pclient->termios;
+}
+
+/* True if we are told when the pty modes change: In packet mode,
+ * TIOCPKT_IOCTL packets report changes, but only while EXTPROC is set.
+ * Otherwise the cached modes are dropped whenever output is read,
+ * since a program that changes modes usually also writes something.
+ */
+static bool
+termios_reported(struct pty_client *pclient)
+{
+#if USE_PTY_PACKET_MODE && TIOCPKT_IOCTL && EXTPROC
+    return pclient->packet_mode && pclient->termios_valid
+        && (pclient->termios.c_lflag & EXTPROC) != 0;
+#else
+    return false;
+#endif
+}
+
+/* Handlers for events reported by the browser (see reportEvent).
+ * data is NUL-terminated, and may be modified.
+ */
+typedef void (*event_handler)(char *data, size_t dlen,
+                              struct lws *wsi, struct tty_client *client);
+
+static void
+event_ws(char *data, size_t dlen, struct lws *wsi, struct tty_client *client)
+{
+    struct pty_client *pclient = client->pclient;
+    if (pclient != NULL
+        && sscanf(data, "%d %d %g %g", &pclient->nrows, &pclient->ncols,
+                  &pclient->pixh, &pclient->pixw) == 4) {
+      if (pclient->pty >= 0)
+        setWindowSize(pclient);
+    }
+}
+
+static void
+event_version(char *data, size_t dlen, struct lws *wsi,
+              struct tty_client *client)
+{
+    struct pty_client *pclient = client->pclient;
+    char *version_info = xmalloc(dlen+1);
+    strcpy(version_info, data);
+    client->initialized = false;
+    client->version_info = version_info;
+    if (pclient == NULL) {
+        char** argv = default_command(main_options);
+        char *cmd = find_in_path(argv[0]);
+        if (cmd != NULL) {
+            pclient = run_command(cmd, argv, ".", environ, main_options);
+            free(cmd);
+        }
+    }
+    if (client->pclient == NULL) // FIXME merge with previous?
+        link_command(wsi, client, pclient);
+    if (pclient->saved_window_contents != NULL
+        || pclient->screen != NULL)
+        request_writable(wsi);
+}
+
+static void
+event_received(char *data, size_t dlen, struct lws *wsi,
+               struct tty_client *client)
+{
+    struct pty_client *pclient = client->pclient;
+    long count;
+    sscanf(data, "%ld", &count);
+    flow_note_received(client, count);
+    if (client->lagging == 1 && pclient != NULL
+        && ((client->sent_count - client->confirmed_count) & MASK28) < 1000) {
+        // Caught up with what was sent before detaching.
+        client->lagging = 2;
+        request_writable(wsi);
+    }
+    if (((client->sent_count - client->confirmed_count) & MASK28)
+        < client->window / 2
+        && pclient->paused)
+        unpause_pty(pclient);
+}
+
+static void
+event_key(char *data, size_t dlen, struct lws *wsi, struct tty_client *client)
+{
+    struct pty_client *pclient = client->pclient;
+    char *q1 = strchr(data, '\t');
+    char *q2;
+    if (q1 == NULL || (q2 = strchr(q1+1, '\t')) == NULL)
+        return; // ERROR
+    struct termios *termios = pty_termios(pclient);
+    bool isCanon = termios != NULL && (termios->c_lflag & ICANON) != 0;
+    bool isEchoing = termios != NULL && (termios->c_lflag & ECHO) != 0;
+    // The key is a JSON string literal.
+    char *kstr = q2 + 1;
+    char *kend = data + dlen;
+    int kstr0 = -1;
+    if (isCanon) {
+        // Only a few single characters are not handled by the browser;
+        // such a character is at most 8 bytes as a literal ("\u0003").
+        char kbuf[8];
+        if (kend - kstr <= 8 && json_unescape(kstr, kend, kbuf) == 1)
+            kstr0 = kbuf[0];
+        if (kstr0 != 3 && kstr0 != 4 && kstr0 != 26) {
+            printf_to_browser(client, URGENT_WRAP("\033]%d;%.*s\007"),
+                              isEchoing ? 74 : 73, (int) dlen, data);
+            request_writable(wsi);
+            return;
+        }
+    }
+    long klen = json_unescape(kstr, kend, kstr);
+    if (klen < 0)
+        return; // ERROR
+    kstr0 = klen != 1 ? -1 : kstr[0];
+    if (termios != NULL && termios->c_cc[VINTR] == kstr0
+        && (termios->c_lflag & NOFLSH) == 0) {
+        // Like the tty, discard pending input on interrupt.
+        discard_pending_input(pclient, 0);
+    }
+    int to_drain = 0;
+    // (A pty thread may be reading the pty, so only drain it here
+    // if this thread reads it.)
+    if (pclient->paused && pclient->chunk == NULL) {
+        // If we see INTR, we want to drain already-buffered data.
+        // But we don't want to drain data that written after the INTR.
+        if (termios != NULL
+            && termios->c_cc[VINTR] == kstr0
+            && ioctl (pclient->pty, FIONREAD, &to_drain) != 0)
+          to_drain = 0;
+    }
+    note_activity(pclient, 1, 0);
+    pty_write(pclient, kstr, klen);
+    while (to_drain > 0) {
+      char buf[500];
+      ssize_t r = read(pclient->pty, buf,
+                       to_drain <= sizeof(buf) ? to_drain : sizeof(buf));
+      if (r <= 0)
+        break;
+      to_drain -= r;
+    }
+}
+
+static void
+event_session_name(char *data, size_t dlen, struct lws *wsi,
+                   struct tty_client *client)
+{
+    struct pty_client *pclient = client->pclient;
+    char *q = strchr(data, '"');
+    long klen = q == NULL ? -1 : json_unescape(q, data + dlen, q);
+    if (klen < 0)
+        return; // ERROR
+    char *session_name = xmalloc(klen+1);
+    memcpy(session_name, q, klen);
+    session_name[klen] = '\0';
+    set_session_name(pclient, session_name);
+}
+
+static void
+event_open_window(char *data, size_t dlen, struct lws *wsi,
+                  struct tty_client *client)
+{
+    static char gopt[] =  "geometry=";
+    char *g = strstr(data, gopt);
+    char *geom = NULL;
+    if (g != NULL) {
+        g += sizeof(gopt)-1;
+        char *gend = strstr(g, "&");
+        if (gend == NULL)
+            gend = g + strlen(g);
+        int glen = gend-g;
+        geom = xmalloc(glen+1);
+        memcpy(geom, g, glen);
+        geom[glen] = 0;
+    }
+    struct options opts;
+    init_options(&opts);
+    opts.geometry = geom;
+    do_run_browser(&opts, data, -1);
+    if (geom != NULL)
+        free(geom);
+}
+
+static void
+event_detach(char *data, size_t dlen, struct lws *wsi,
+             struct tty_client *client)
+{
+    struct pty_client *pclient = client->pclient;
+    bool val = strcmp(data,"0")!=0;
+    if (pclient != NULL) {
+        pclient->detachOnClose = val; // OLD
+        client->detach_on_close = (bool)val;
+        if (! pclient->preserving && pclient->screen == NULL
+            && client->requesting_contents == 0)
+            client->requesting_contents = 1;
+    }
+}
+
+static void
+event_focused(char *data, size_t dlen, struct lws *wsi,
+              struct tty_client *client)
+{
+    focused_wsi = wsi;
+}
+
+static void
+event_link(char *data, size_t dlen, struct lws *wsi, struct tty_client *client)
+{
+    json_object *obj = json_tokener_parse(data);
+    handle_link(obj);
+    json_object_put(obj);
+}
+
+static void
+event_window_contents(char *data, size_t dlen, struct lws *wsi,
+                      struct tty_client *client)
+{
+    struct pty_client *pclient = client->pclient;
+    char *q = strchr(data, ',');
+    long rcount;
+    sscanf(data, "%ld", &rcount);
+    int updated = (rcount - pclient->preserved_sent_count) & MASK28;
+    // Roughly: if (rcount < pclient->preserved_sent_count)
+    if ((updated & ((MASK28+1)>>1)) != 0) {
+        return;
+    }
+    if (pclient->saved_window_contents != NULL)
+        free(pclient->saved_window_contents);
+    pclient->saved_window_contents = strdup(q+1);
+    client->requesting_contents = 0;
+    if (pclient->spool != NULL)
+        spool_clear(pclient->spool);
+
+    // Output up to rcount is included in the saved contents.
+    long old_length = pclient->output->end - pclient->preserved_start;
+    pclient->preserved_start += updated < old_length ? updated : old_length;
+    pclient->preserved_sent_count = rcount;
+    trim_output(pclient);
+    struct lws *twsi;
+    FOREACH_WSCLIENT(twsi, pclient) {
+        if (((struct tty_client *) lws_wsi_user(twsi))->lagging == 2)
+            request_writable(twsi);
+    }
+}
+
+static void
+event_echo_urgent(char *data, size_t dlen, struct lws *wsi,
+                  struct tty_client *client)
+{
+    struct pty_client *pclient = client->pclient;
+    long klen = json_unescape(data, data + dlen, data);
+    if (klen < 0)
+        return; // ERROR
+    struct lws *tty_wsi;
+    FOREACH_WSCLIENT(tty_wsi, pclient) {
+        struct tty_client *t =
+            (struct tty_client *) lws_wsi_user(tty_wsi);
+        printf_to_browser(t, URGENT_WRAP("%.*s"), (int) klen, data);
+        request_writable(tty_wsi);
+    }
+}
+
+/* Start a streamed paste: data is "id bracketed length". */
+static void
+event_paste_start(char *data, size_t dlen, struct lws *wsi,
+                  struct tty_client *client)
+{
+    struct pty_client *pclient = client->pclient;
+    int id, bracketed;
+    long length;
+    if (pclient == NULL
+        || sscanf(data, "%d %d %ld", &id, &bracketed, &length) != 3
+        || id < 0)
+        return; // ERROR
+    if (bracketed)
+        pty_write(pclient, "\033[200~", 6);
+    client->paste_id = id;
+    client->paste_bracketed = bracketed != 0;
+    client->paste_ended = false;
+    client->paste_start = pclient->input_queued;
+    client->paste_chunks = 0;
+    client->paste_acked = 0;
+    // Acknowledge the start, so the browser sends the first chunks.
+    printf_to_browser(client, URGENT_WRAP("\033[93;%d;0u"), id);
+    request_writable(wsi);
+}
+
+/* A chunk of a streamed paste: data is "id seq json-string". */
+static void
+event_paste_data(char *data, size_t dlen, struct lws *wsi,
+                 struct tty_client *client)
+{
+    struct pty_client *pclient = client->pclient;
+    int id, seq, n;
+    if (pclient == NULL
+        || sscanf(data, "%d %d %n", &id, &seq, &n) != 2
+        || id != client->paste_id || client->paste_ended
+        || seq != client->paste_chunks
+        || seq - client->paste_acked >= PASTE_WINDOW)
+        return; // ERROR (or a stale chunk)
+    char *str = data + n;
+    long slen = json_unescape(str, data + dlen, str);
+    if (slen < 0)
+        return; // ERROR
+    note_activity(pclient, 1, 0);
+    pty_write(pclient, str, slen);
+    client->paste_ends[seq % PASTE_WINDOW] = pclient->input_queued;
+    client->paste_chunks = seq + 1;
+    paste_check_acks(client);
+}
+
+static void
+event_paste_end(char *data, size_t dlen, struct lws *wsi,
+                struct tty_client *client)
 {
-    if (json_object_object_get_ex(obj, "filename", NULL)) {
-        char *template = main_options->openfile_application;
-        if (template == NULL)
-            template =
-              "{in-atom}{with-position|!.html}atom;"
-              "{with-position|!.html}emacsclient;"
-              "{with-position|!.html}emacs;"
-              "{with-position|!.html}atom";
-        if (handle_tlink(template, obj))
-            return;
-    }
-    char *template = main_options->openlink_application;
-    if (template == NULL)
-        template = "{!mailto:}browser;{!mailto:}chrome;{!mailto:}firefox";
-    handle_tlink(template, obj);
+    struct pty_client *pclient = client->pclient;
+    if (pclient == NULL || strtol(data, NULL, 10) != client->paste_id
+        || client->paste_id < 0)
+        return;
+    if (client->paste_bracketed)
+        pty_write(pclient, "\033[201~", 6);
+    client->paste_ended = true;
+    if (client->paste_chunks == client->paste_acked)
+        client->paste_id = -1;
 }
 
-void
-reportEvent(const char *name, char *data, size_t dlen,
-            struct lws *wsi, struct tty_client *client)
+/* Cancel a streamed paste, discarding what has not reached the pty. */
+static void
+event_paste_cancel(char *data, size_t dlen, struct lws *wsi,
+                   struct tty_client *client)
 {
     struct pty_client *pclient = client->pclient;
-    // FIXME call reportEvent(cname, data)
-    if (strcmp(name, "WS") == 0) {
-        if (pclient != NULL
-            && sscanf(data, "%d %d %g %g", &pclient->nrows, &pclient->ncols,
-                      &pclient->pixh, &pclient->pixw) == 4) {
-          if (pclient->pty >= 0)
-            setWindowSize(pclient);
-        }
-    } else if (strcmp(name, "VERSION") == 0) {
-        char *version_info = xmalloc(dlen+1);
-        strcpy(version_info, data);
-        client->initialized = false;
-        client->version_info = version_info;
-        if (pclient == NULL) {
-            char** argv = default_command(main_options);
-            char *cmd = find_in_path(argv[0]);
-            if (cmd != NULL) {
-                pclient = run_command(cmd, argv, ".", environ, main_options);
-                free(cmd);
-            }
-        }
-        if (client->pclient == NULL) // FIXME merge with previous?
-            link_command(wsi, client, pclient);
-        if (pclient->saved_window_contents != NULL)
-            lws_callback_on_writable(wsi);
-    } else if (strcmp(name, "RECEIVED") == 0) {
-        long count;
-        sscanf(data, "%ld", &count);
-        client->confirmed_count = count;
-        if (((client->sent_count - client->confirmed_count) & MASK28) < 1000
-            && pclient->paused) {
-#if USE_RXFLOW
-            lws_rx_flow_control(pclient->pty_wsi,
-                                1|LWS_RXFLOW_REASON_FLAG_PROCESS_NOW);
-#endif
-            pclient->paused = 0;
-        }
-    } else if (strcmp(name, "KEY") == 0) {
-        char *q1 = strchr(data, '\t');
-        char *q2;
-        if (q1 == NULL || (q2 = strchr(q1+1, '\t')) == NULL)
-            return; // ERROR
-        struct termios termios;
-        if (tcgetattr(pclient->pty, &termios) < 0)
-          ; //return -1;
-        bool isCanon = (termios.c_lflag & ICANON) != 0;
-        bool isEchoing = (termios.c_lflag & ECHO) != 0;
-        json_object *obj = json_tokener_parse(q2+1);
-        const char *kstr = json_object_get_string(obj);
-        int klen = json_object_get_string_len(obj);
-        int kstr0 = klen != 1 ? -1 : kstr[0];
-        if (isCanon && kstr0 != 3 && kstr0 != 4 && kstr0 != 26) {
-            printf_to_browser(client, URGENT_WRAP("\033]%d;%.*s\007"),
-                              isEchoing ? 74 : 73, (int) dlen, data);
-            lws_callback_on_writable(wsi);
-        } else {
-          int to_drain = 0;
-          if (pclient->paused) {
-            struct termios term;
-            // If we see INTR, we want to drain already-buffered data.
-            // But we don't want to drain data that written after the INTR.
-            if (tcgetattr(pclient->pty, &term) == 0
-                && term.c_cc[VINTR] == kstr0
-                && ioctl (pclient->pty, FIONREAD, &to_drain) != 0)
-              to_drain = 0;
-          }
-          if (write(pclient->pty, kstr, klen) < klen)
-             lwsl_err("write INPUT to pty\n");
-          while (to_drain > 0) {
-            char buf[500];
-            ssize_t r = read(pclient->pty, buf,
-                             to_drain <= sizeof(buf) ? to_drain : sizeof(buf));
-            if (r <= 0)
-              break;
-            to_drain -= r;
-          }
-        }
-        json_object_put(obj);
-    } else if (strcmp(name, "SESSION-NAME") == 0) {
-        char *q = strchr(data, '"');
-        json_object *obj = json_tokener_parse(q);
-        const char *kstr = json_object_get_string(obj);
-        int klen = json_object_get_string_len(obj);
-        char *session_name = xmalloc(klen+1);
-        strcpy(session_name, kstr);
-        if (pclient->session_name)
-            free(pclient->session_name);
-        pclient->session_name = session_name;
-        pclient->session_name_unique = true;
-        json_object_put(obj);
-        for (struct pty_client *p = pty_client_list;
-             p != NULL; p = p->next_pty_client) {
-            if (p != pclient && p->session_name != NULL
-                && strcmp(session_name, p->session_name) == 0) {
-                struct lws *twsi;
-                struct pty_client *pp = p;
-                p->session_name_unique = false;
-                for (;;) {
-                    FOREACH_WSCLIENT(twsi, pp) {
-                        struct tty_client *t =
-                            (struct tty_client *) lws_wsi_user(twsi);
-                        t->pty_window_update_needed = true;
-                        lws_callback_on_writable(twsi);
-                    }
-                    if (! pclient->session_name_unique || pp == pclient)
-                        break;
-                    pp = pclient;
-                }
-                pclient->session_name_unique = false;
-            }
-        }
-    } else if (strcmp(name, "OPEN-WINDOW") == 0) {
-        static char gopt[] =  "geometry=";
-        char *g = strstr(data, gopt);
-        char *geom = NULL;
-        if (g != NULL) {
-            g += sizeof(gopt)-1;
-            char *gend = strstr(g, "&");
-            if (gend == NULL)
-                gend = g + strlen(g);
-            int glen = gend-g;
-            geom = xmalloc(glen+1);
-            memcpy(geom, g, glen);
-            geom[glen] = 0;
-        }
-        struct options opts;
-        init_options(&opts);
-        opts.geometry = geom;
-        do_run_browser(&opts, data, -1);
-        if (geom != NULL)
-            free(geom);
-    } else if (strcmp(name, "DETACH") == 0) {
-        bool val = strcmp(data,"0")!=0;
-        if (pclient != NULL) {
-            pclient->detachOnClose = val; // OLD
-            client->detach_on_close = (bool)val;
-            if (pclient->preserved_output == NULL
-                && client->requesting_contents == 0)
-                client->requesting_contents = 1;
-        }
-    } else if (strcmp(name, "FOCUSED") == 0) {
-        focused_wsi = wsi;
-    } else if (strcmp(name, "LINK") == 0) {
-        json_object *obj = json_tokener_parse(data);
-        handle_link(obj);
-        json_object_put(obj);
-    } else if (strcmp(name, "WINDOW-CONTENTS") == 0) {
-        char *q = strchr(data, ',');
-        long rcount;
-        sscanf(data, "%ld", &rcount);
-        int updated = (rcount - pclient->preserved_sent_count) & MASK28;
-        // Roughly: if (rcount < pclient->preserved_sent_count)
-        if ((updated & ((MASK28+1)>>1)) != 0) {
-            return;
-        }
-        if (pclient->saved_window_contents != NULL)
-            free(pclient->saved_window_contents);
-        pclient->saved_window_contents = strdup(q+1);
-        client->requesting_contents = 0;
+    if (pclient == NULL || strtol(data, NULL, 10) != client->paste_id
+        || client->paste_id < 0)
+        return;
+    client->paste_id = -1;
+    // Only input queued before the paste started is kept.
+    discard_pending_input(pclient,
+                          client->paste_start - pclient->input_written);
+    if (client->paste_bracketed && ! client->paste_ended)
+        pty_write(pclient, "\033[201~", 6);
+}
 
-        int old_length = pclient->preserved_end - pclient->preserved_start; 
-        if (pclient->preserved_output == NULL)
-          ; // do nothing
-        else if (updated >= old_length) {
-            pclient->preserved_start = PRESERVE_MIN;
-            pclient->preserved_end = pclient->preserved_start;
-        }
-        else if (pclient->preserved_start + updated < 200)
-           pclient->preserved_start += updated;
-        else {
-            int new_length = old_length - updated;
-            memmove(pclient->preserved_output + PRESERVE_MIN,
-                    pclient->preserved_output+pclient->preserved_start+updated,
-                    new_length);
-            pclient->preserved_start = PRESERVE_MIN;
-            pclient->preserved_end = PRESERVE_MIN + new_length;
-        }
-        pclient->preserved_sent_count = rcount;
-    } else if (strcmp(name, "ECHO-URGENT") == 0) {
-        json_object *obj = json_tokener_parse(data);
-        const char *kstr = json_object_get_string(obj);
-        struct lws *tty_wsi;
-        FOREACH_WSCLIENT(tty_wsi, pclient) {
-            struct tty_client *t =
-                (struct tty_client *) lws_wsi_user(tty_wsi);
-            printf_to_browser(t, URGENT_WRAP("%s"), kstr);
-            lws_callback_on_writable(tty_wsi);
+struct event_entry {
+    const char *name;
+    event_handler handler;
+    // True if the handler doesn't use the pty, so input received
+    // before the event need not be written first.
+    bool no_pty;
+};
+
+static const struct event_entry event_handlers[] = {
+    { "WS", event_ws, false },
+    { "VERSION", event_version, false },
+    { "RECEIVED", event_received, true },
+    { "KEY", event_key, false },
+    { "SESSION-NAME", event_session_name, false },
+    { "OPEN-WINDOW", event_open_window, false },
+    { "DETACH", event_detach, false },
+    { "FOCUSED", event_focused, true },
+    { "LINK", event_link, true },
+    { "WINDOW-CONTENTS", event_window_contents, true },
+    { "ECHO-URGENT", event_echo_urgent, true },
+    { "PASTE-START", event_paste_start, false },
+    { "PASTE-DATA", event_paste_data, false },
+    { "PASTE-END", event_paste_end, false },
+    { "PASTE-CANCEL", event_paste_cancel, false },
+};
+
+// Hash table of event_handlers indexes (plus 1; 0 if empty), with
+// linear probing - though the current names have no collisions.
+#define EVENT_HASH_SIZE 32
+static unsigned char event_hash[EVENT_HASH_SIZE];
+static bool event_hash_ready = false;
+
+static unsigned
+event_name_hash(const char *name, size_t len)
+{
+    return ((unsigned char) name[0] + 2 * (unsigned char) name[len-1] + len)
+        & (EVENT_HASH_SIZE - 1);
+}
+
+static const struct event_entry *
+find_event(const char *name)
+{
+    size_t len = strlen(name);
+    int n = sizeof(event_handlers) / sizeof(event_handlers[0]);
+    if (! event_hash_ready) {
+        event_hash_ready = true;
+        for (int i = 0; i < n; i++) {
+            const char *ename = event_handlers[i].name;
+            unsigned h = event_name_hash(ename, strlen(ename));
+            while (event_hash[h] != 0)
+                h = (h + 1) & (EVENT_HASH_SIZE - 1);
+            event_hash[h] = i + 1;
         }
-        json_object_put(obj);
-    } else {
     }
+    if (len == 0)
+        return NULL;
+    for (unsigned h = event_name_hash(name, len); event_hash[h] != 0;
+         h = (h + 1) & (EVENT_HASH_SIZE - 1)) {
+        int i = event_hash[h] - 1;
+        if (strcmp(name, event_handlers[i].name) == 0)
+            return &event_handlers[i];
+    }
+    return NULL;
+}
+
+void
+reportEvent(const char *name, char *data, size_t dlen,
+            struct lws *wsi, struct tty_client *client)
+{
+    const struct event_entry *event = find_event(name);
+    if (event != NULL)
+        event->handler(data, dlen, wsi, client);
 }
 
 int
@@ -945,19 +2473,31 @@ callback_tty(struct lws *wsi, enum lws_callback_reasons reason,
         client->authenticated = false;
         client->requesting_contents = 0;
         client->wsi = wsi;
-        client->buffer = NULL;
+        sbuf_init(&client->inbuf);
         client->version_info = NULL;
         client->pclient = NULL;
         client->sent_count = 0;
         client->confirmed_count = 0;
+        flow_reset(client);
         sbuf_init(&client->ob);
         sbuf_extend(&client->ob, 2048);
         sbuf_blank(&client->ob, LWS_PRE);
-        client->ocount = 0;
+        sbuf_init(&client->wb);
+        sbuf_extend(&client->wb, 2048);
+        sbuf_blank(&client->wb, LWS_PRE);
+        client->output = NULL;
+        client->output_pos = 0;
+        client->lagging = 0;
         client->detach_on_close = false;
         client->connection_number = ++server->connection_count;
         client->pty_window_number = -1;
         client->pty_window_update_needed = false;
+        client->tsi = service_tsi;
+        client->requests = 0;
+        client->input_paused = false;
+        client->paste_id = -1;
+        client->exit_status = -1;
+        client->waiting_pid = 0;
         {
              char arg[100]; // FIXME
              if (! check_server_key(wsi, arg, sizeof(arg) - 1))
@@ -966,13 +2506,9 @@ callback_tty(struct lws *wsi, enum lws_callback_reasons reason,
              int cpid;
              if (connect_pid != NULL
                  && (cpid = strtol(connect_pid, NULL, 10)) != 0) {
-                  struct pty_client *pclient = pty_client_list;
-                  for (; pclient != NULL; pclient = pclient->next_pty_client) {
-                       if (pclient->pid == cpid) {
-                            link_command(wsi, client, pclient);
-                            break;
-                       }
-                  }
+                  struct pty_client *pclient = find_session_by_pid(cpid);
+                  if (pclient != NULL)
+                       link_command(wsi, client, pclient);
              }
         }
         lws_get_peer_addresses(wsi, lws_get_socket_fd(wsi),
@@ -989,12 +2525,27 @@ callback_tty(struct lws *wsi, enum lws_callback_reasons reason,
     case LWS_CALLBACK_SERVER_WRITEABLE:
          //fprintf(stderr, "callback_tty CALLBACK_SERVER_WRITEABLE init:%d connect:%d\n", (int) client->initialized, client->connection_number);
         ;
-        struct sbuf buf;
-        sbuf_init(&buf);
-        sbuf_blank(&buf, LWS_PRE);
-
-        if (! client->initialized
-            && (pclient->preserved_output == NULL
+        // The frame is built in wb (after LWS_PRE bytes of headroom),
+        // which is kept for the next frame.
+        struct sbuf buf = client->wb;
+        buf.len = LWS_PRE;
+
+        // A lagging client that has caught up is re-initialized from
+        // the screen model, or saved window contents if we have them
+        // or can get them.
+        bool resync = false;
+        if (client->lagging == 2 && pclient != NULL
+            && (pclient->screen != NULL
+                || pclient->saved_window_contents != NULL
+                || ! request_window_contents(pclient))) {
+            resync = true;
+            client->lagging = 0;
+            client->initialized = false;
+            if (client->output_pos < pclient->output->start)
+                client->output_pos = pclient->output->start;
+        }
+        if (! client->initialized && pclient != NULL
+            && (pclient->screen != NULL || ! pclient->preserving
                 || pclient->saved_window_contents != NULL)) {
 #define FORMAT_PID_SNUMBER "\033]31;%d\007\033[91;%d;%d\007"
 #define FORMAT_SNAME "\033]30;%s\007"
@@ -1005,29 +2556,75 @@ callback_tty(struct lws *wsi, enum lws_callback_reasons reason,
                         pclient->pid,
                         pclient->session_number, pclient->session_name_unique,
                         pclient->session_name);
-            if (pclient->saved_window_contents != NULL) {
-                int rcount = pclient->preserved_sent_count;
+            if (pclient->screen != NULL) {
+                // The model reflects all output read so far,
+                // so the snapshot replaces any output not yet sent.
+#if USE_LWS_TIMER
+                // Give other windows the changes the snapshot includes.
+                if (pclient->flooding)
+                    flood_frame(pclient);
+#endif
+                size_t start = buf.len;
+                if (resync)
+                    sbuf_printf(&buf, "%s", resync_reset);
+                screen_snapshot(pclient->screen, &buf);
+                client->output_pos = pclient->output->end;
+                client->sent_count =
+                    (client->sent_count + buf.len - start) & MASK28;
+            } else if (pclient->saved_window_contents != NULL
+                       && (pclient->spool == NULL
+                           || pclient->spool->dropped == 0)) {
+                // The spool has output from before preserved_start.
+                struct spool *spool = pclient->spool;
+                long spooled = spool == NULL ? 0 : spool->length;
+                int rcount = pclient->preserved_sent_count - spooled;
                 sbuf_printf(&buf,
                             URGENT_WRAP("\033]103;%ld,%s\007"),
-                            (long) pclient->preserved_sent_count,
+                            (long) (rcount & MASK28),
                             (char *) pclient->saved_window_contents);
                 if (! should_backup_output(pclient)) {
                     free(pclient->saved_window_contents);
                     pclient->saved_window_contents = NULL;
                 }
-                if (pclient->preserved_output != NULL) {
-                    size_t start = pclient->preserved_start;
-                    size_t end = pclient->preserved_end;
-                    sbuf_printf(&buf, "%s%.*s%s",
-                                start_replay_mode,
-                                (int) (end-start),
-                                pclient->preserved_output+start,
-                                end_replay_mode);
-                    rcount += end - start;
+                if (pclient->preserving) {
+                    // Replay preserved output this client has not seen;
+                    // skip pending output that is already in the contents.
+                    long start = pclient->preserved_start;
+                    if (client->output_pos < start)
+                        client->output_pos = start;
+                    size_t rlen = client->output_pos - start;
+                    sbuf_printf(&buf, "%s", start_replay_mode);
+                    if (spool != NULL)
+                        spool_copy_out(spool, &buf);
+                    rcount += spooled;
+                    sbuf_extend(&buf, rlen);
+                    ring_copy_out(pclient->output, start, rlen,
+                                  buf.buffer + buf.len);
+                    buf.len += rlen;
+                    sbuf_printf(&buf, "%s", end_replay_mode);
+                    rcount += rlen;
                 }
+                if (pclient->saved_window_contents == NULL && spool != NULL)
+                    spool_clear(spool);
                 rcount = rcount & MASK28;
                 client->sent_count = rcount;
                 client->confirmed_count = rcount;
+                flow_reset(client);
+                sbuf_printf(&buf,
+                            OUT_OF_BAND_START_STRING "\033[96;%du"
+                            URGENT_END_STRING,
+                            rcount);
+            } else if (pclient->spool != NULL && pclient->spool->length > 0) {
+                // Either there are no saved contents, or output after
+                // them was dropped from the spool, so they are useless.
+                if (pclient->saved_window_contents != NULL) {
+                    free(pclient->saved_window_contents);
+                    pclient->saved_window_contents = NULL;
+                }
+                int rcount = replay_spool(client, pclient, &buf) & MASK28;
+                client->sent_count = rcount;
+                client->confirmed_count = rcount;
+                flow_reset(client);
                 sbuf_printf(&buf,
                             OUT_OF_BAND_START_STRING "\033[96;%du"
                             URGENT_END_STRING,
@@ -1059,37 +2656,82 @@ callback_tty(struct lws *wsi, enum lws_callback_reasons reason,
             client->detachSaveSend = false;
         }
         if (client->ob.len > LWS_PRE) {
-            client->sent_count = (client->sent_count + client->ocount) & MASK28;
-            sbuf_printf(&buf, "%.*s", (int) client->ob.len-LWS_PRE,
-                        client->ob.buffer+LWS_PRE);
-            client->ocount = 0;
-            if (client->ob.size > 4000) {
-                sbuf_free(&client->ob);
-                sbuf_extend(&client->ob, 2048);
+            if (buf.len == LWS_PRE) {
+                // Just send ob, and use buf for the next messages.
+                struct sbuf t = client->ob;
+                client->ob = buf;
+                buf = t;
+            } else {
+                sbuf_append(&buf, client->ob.buffer+LWS_PRE,
+                            client->ob.len-LWS_PRE);
+                client->ob.len = LWS_PRE;
+                if (client->ob.size > WRITE_BUFFER_KEEP) {
+                    sbuf_free(&client->ob);
+                    sbuf_extend(&client->ob, 2048);
+                    sbuf_blank(&client->ob, LWS_PRE);
+                }
             }
-            client->ob.len = LWS_PRE;
+        }
+        struct ring *output = client->output;
+        char *odata = NULL;
+        size_t olen = output == NULL || client->lagging ? 0
+            : ring_span(output, client->output_pos, output->end, &odata);
+        // Output goes directly from the ring, unless we have to
+        // combine it with other messages in a single frame, or other
+        // threads may change the ring while we write (unlocked).
+        if (olen > 0
+            && (buf.len > LWS_PRE || client->requesting_contents == 1
+                || ! pclient || service_threads > 1)) {
+            sbuf_append(&buf, odata, olen);
+            advance_output(client, olen);
+            olen = 0;
         }
         if (client->requesting_contents == 1) {
             sbuf_printf(&buf, "%s", request_contents_message);
             client->requesting_contents = 2;
-            if (pclient->preserved_output == NULL) {
-                pclient->preserved_start = PRESERVE_MIN;
-                pclient->preserved_end = pclient->preserved_start;
-                pclient->preserved_size = 1024;
-                pclient->preserved_output =
-                    xmalloc(pclient->preserved_size);
-            }
+            pclient->preserving = true;
+            pclient->preserved_start = client->output_pos;
             pclient->preserved_sent_count = client->sent_count;
         }
-        if (! pclient && client->ob.buffer != NULL) {
-            sbuf_printf(&buf, "%s", eof_message);
+        bool more_output = output != NULL && ! client->lagging
+            && client->output_pos + (long) olen < output->end;
+        if (! pclient && ! more_output && client->ob.buffer != NULL
+            && client->waiting_pid == 0) {
+            if (client->exit_status >= 0)
+                sbuf_printf(&buf, URGENT_WRAP("\033[99;99;%du"),
+                            client->exit_status);
+            else
+                sbuf_printf(&buf, "%s", eof_message);
             sbuf_free(&client->ob);
+            ring_unref(client->output);
+            client->output = NULL;
         }
         int written = buf.len - LWS_PRE;
-        if (written > 0
-            && lws_write(wsi, buf.buffer+LWS_PRE, written, LWS_WRITE_BINARY) != written)
-            lwsl_err("lws_write\n");
-        sbuf_free(&buf);
+        if (written > 0) {
+            // Let other threads run while lws frames and compresses.
+            int depth = service_unlock_all();
+            if (lws_write(wsi, buf.buffer+LWS_PRE, written, LWS_WRITE_BINARY) != written)
+                lwsl_err("lws_write\n");
+            service_relock(depth);
+            pclient = client->pclient;
+        }
+        // Don't keep a big buffer (after sending window contents, say).
+        if (buf.size > WRITE_BUFFER_KEEP) {
+            sbuf_free(&buf);
+            sbuf_extend(&buf, 2048);
+            sbuf_blank(&buf, LWS_PRE);
+        }
+        client->wb = buf;
+        if (olen > 0) {
+            if (write_output_span(wsi, odata, olen) != (int) olen)
+                lwsl_err("lws_write\n");
+            advance_output(client, olen);
+        }
+        flow_note_sent(client);
+        if (more_output)
+            request_writable(wsi);
+        if (pclient != NULL)
+            trim_output(pclient);
         client->initialized = true;
         break;
     buffer_too_small:
@@ -1100,16 +2742,10 @@ callback_tty(struct lws *wsi, enum lws_callback_reasons reason,
     case LWS_CALLBACK_RECEIVE:
          // receive data from websockets client (browser)
          //fprintf(stderr, "callback_tty CALLBACK_RECEIVE len:%d\n", (int) len);
-         if (client->buffer == NULL) {
-              client->buffer = xmalloc(len + 1);
-              client->len = len;
-              memcpy(client->buffer, in, len);
-         } else {
-              client->buffer = xrealloc(client->buffer, client->len + len + 1);
-              memcpy(client->buffer + client->len, in, len);
-              client->len += len;
-         }
-         client->buffer[client->len] = '\0';
+         sbuf_extend(&client->inbuf, len + 1);
+         memcpy(client->inbuf.buffer + client->inbuf.len, in, len);
+         client->inbuf.len += len;
+         client->inbuf.buffer[client->inbuf.len] = '\0';
 
          // check if there are more fragmented messages
          if (lws_remaining_packet_payload(wsi) > 0 || !lws_is_final_fragment(wsi)) {
@@ -1118,62 +2754,74 @@ callback_tty(struct lws *wsi, enum lws_callback_reasons reason,
 
          if (server->options.readonly)
               return 0;
-         size_t clen = client->len;
-         unsigned char *msg = (unsigned char*) client->buffer;
+         size_t clen = client->inbuf.len;
+         unsigned char *msg = (unsigned char*) client->inbuf.buffer;
          struct pty_client *pclient = client->pclient;
          if (pclient)
              pclient->recent_tclient = client;
-         // FIXME handle PENDING
-         int start = 0;
-         for (int i = 0; ; i++) {
-              if (i+1 == clen && msg[i] >= 128)
-                   break;
-              // 0x92 (utf-8 0xc2,0x92) "Private Use 2".
-              if (i == clen || msg[i] == 0x92
-                  || (msg[i] == 0xc2 && msg[i+1] == 0x92)) {
-                   int w = i - start;
-                   if (w > 0 && write(pclient->pty, msg+start, w) < w) {
-                        lwsl_err("write INPUT to pty\n");
-                        return -1;
+         // Runs of plain input, written to the pty in one writev.
+         struct iovec iov[RECEIVE_IOV_MAX];
+         int niov = 0;
+         bool any_input = false;
+         size_t start = 0;
+         for (;;) {
+              // 0x92 (utf-8 0xc2,0x92) "Private Use 2" starts an event.
+              unsigned char *ev = memchr(msg+start, 0x92, clen-start);
+              size_t i = ev == NULL ? clen : (size_t) (ev - msg);
+              size_t end = i;
+              // A trailing 0xc2 may be the start of a split 0xc2,0x92.
+              if (end > start && msg[end-1] == 0xc2)
+                   end--;
+              if (end > start && pclient != NULL) {
+                   iov[niov].iov_base = msg + start;
+                   iov[niov].iov_len = end - start;
+                   any_input = true;
+                   if (++niov == RECEIVE_IOV_MAX) {
+                        pty_writev(pclient, iov, niov);
+                        niov = 0;
                    }
-                   if (i == clen) {
-                        start = clen;
-                        break;
-                   }
-                   // look for reported event
-                   if (msg[i] == 0xc2)
-                        i++;
-                   unsigned char* eol = memchr(msg+i, '\n', clen-i);
-                   if (eol) {
-                        unsigned char *p = msg+i;
-                        char* cname = (char*) ++p;
-                        while (p < eol && *p != ' ')
-                             p++;
-                        *p = '\0';
-                        if (p < eol)
-                             p++;
-                        while (p < eol && *p == ' ')
-                             p++;
-                        // data is from p to eol
-                        char *data = (char*) p;
-                        *eol = '\0';
-                        size_t dlen = eol - p;
-                        reportEvent(cname, data, dlen, wsi, client);
-                        i = eol - msg;
-                   } else {
-                        break;
+              }
+              start = end;
+              if (ev == NULL)
+                   break;
+              unsigned char* eol = memchr(ev, '\n', clen-i);
+              if (eol == NULL)
+                   break;
+              unsigned char *p = ev;
+              char* cname = (char*) ++p;
+              while (p < eol && *p != ' ')
+                   p++;
+              *p = '\0';
+              if (p < eol)
+                   p++;
+              while (p < eol && *p == ' ')
+                   p++;
+              // data is from p to eol
+              char *data = (char*) p;
+              *eol = '\0';
+              size_t dlen = eol - p;
+              const struct event_entry *event = find_event(cname);
+              if (event != NULL) {
+                   if (niov > 0 && ! event->no_pty) {
+                        pty_writev(pclient, iov, niov);
+                        niov = 0;
                    }
-                   start = i+1;
+                   event->handler(data, dlen, wsi, client);
+                   pclient = client->pclient;
               }
+              start = eol - msg + 1;
          }
-         if (start < clen) {
-              memmove(client->buffer, client->buffer+start, clen-start);
-              client->len = clen - start;
-         }
-         else if (client->buffer != NULL) {
-              free(client->buffer);
-              client->buffer = NULL;
-         }
+         if (niov > 0)
+              pty_writev(pclient, iov, niov);
+         if (any_input && pclient != NULL)
+              note_activity(pclient, 1, 0);
+         // Keep an incomplete event (or split delimiter) for next time.
+         client->inbuf.len = clen - start;
+         if (start < clen)
+              memmove(msg, msg+start, clen-start);
+         else if (client->inbuf.size > WRITE_BUFFER_KEEP)
+              sbuf_free(&client->inbuf);
+         check_input_limit(client);
          break;
 
     case LWS_CALLBACK_CLOSED:
@@ -1185,10 +2833,7 @@ callback_tty(struct lws *wsi, enum lws_callback_reasons reason,
               free(client->version_info);
               client->version_info = NULL;
          }
-         if (client->buffer != NULL) {
-              free(client->buffer);
-              client->buffer = NULL;
-         }
+         sbuf_free(&client->inbuf);
          break;
 
     case LWS_CALLBACK_PROTOCOL_INIT: /* per vhost */
@@ -1290,7 +2935,7 @@ int new_action(int argc, char** argv, const char*cwd, char **env,
     struct pty_client *pclient = run_command(cmd, args, cwd, env, opts);
     free(cmd);
     if (opts->session_name) {
-        pclient->session_name = strdup(opts->session_name);
+        set_session_name(pclient, strdup(opts->session_name));
         opts->session_name = NULL;
     }
     return display_session(opts, pclient, NULL, http_port);
@@ -1317,18 +2962,21 @@ int attach_action(int argc, char** argv, const char*cwd,
     }
 
     // If there is an existing tty_client, request contents from browser,
-    // if not already doing do.
-    struct lws *tty_wsi;
-    FOREACH_WSCLIENT(tty_wsi, pclient) {
-        if (((struct tty_client *) lws_wsi_user(tty_wsi))
-            ->requesting_contents > 0)
-            break;
-    }
-    if (tty_wsi == NULL && (tty_wsi = pclient->first_client_wsi) != NULL) {
-        struct tty_client *tclient =
-            (struct tty_client *) lws_wsi_user(tty_wsi);
-        tclient->requesting_contents = 1;
-        lws_callback_on_writable(tty_wsi);
+    // if not already doing do.  Not needed if we have a screen model.
+    if (pclient->screen == NULL) {
+        struct lws *tty_wsi;
+        FOREACH_WSCLIENT(tty_wsi, pclient) {
+            if (((struct tty_client *) lws_wsi_user(tty_wsi))
+                ->requesting_contents > 0)
+                break;
+        }
+        if (tty_wsi == NULL
+            && (tty_wsi = pclient->first_client_wsi) != NULL) {
+            struct tty_client *tclient =
+                (struct tty_client *) lws_wsi_user(tty_wsi);
+            tclient->requesting_contents = 1;
+            request_writable(tty_wsi);
+        }
     }
 
     display_session(opts, pclient, NULL, http_port);
@@ -1361,7 +3009,7 @@ request_upload_settings()
         FOREACH_WSCLIENT(twsi, pclient) {
             struct tty_client *tclient = (struct tty_client *) lws_wsi_user(twsi);
             tclient->uploadSettingsNeeded = true;
-            lws_callback_on_writable(twsi);
+            request_writable(twsi);
         }
     }
 }
@@ -1378,15 +3026,10 @@ handle_command(int argc, char** argv, const char*cwd,
         char *p = strstr(domterm_env_value, pid_key);
         if (p)
             sscanf(p+(sizeof(pid_key)-1), "%d", &current_session_pid);
-        if (current_session_pid) {
-            struct pty_client *pclient = pty_client_list;
-            for (; pclient != NULL; pclient = pclient->next_pty_client) {
-                if (pclient->pid == current_session_pid) {
-                    opts->requesting_session = pclient;
-                    break;
-                }
-            }
-        }
+        struct pty_client *pclient = current_session_pid == 0 ? NULL
+            : find_session_by_pid(current_session_pid);
+        if (pclient != NULL)
+            opts->requesting_session = pclient;
     }
     if (command != NULL) {
         return (*command->action)(argc, argv, cwd, env, wsi, opts);
@@ -1403,110 +3046,387 @@ handle_command(int argc, char** argv, const char*cwd,
     return 0;
 }
 
+// Environments of recent clients, so they need only send a digest.
+// The digest is not collision-resistant, so the count and total length
+// of the strings must match too.
+#define ENV_CACHE_SIZE 16
+static struct env_cache_entry {
+    uint64_t digest;
+    uint32_t envc;
+    size_t length; // of the strings, including their NULs
+    char **env; // one block: the pointers, then the strings
+    long last_used;
+} env_cache[ENV_CACHE_SIZE];
+static long env_cache_counter = 0;
+
+static struct env_cache_entry *
+env_cache_find(uint64_t digest, uint32_t envc, size_t length)
+{
+    for (int i = 0; i < ENV_CACHE_SIZE; i++) {
+        struct env_cache_entry *entry = &env_cache[i];
+        if (entry->env != NULL && entry->digest == digest
+            && entry->envc == envc && entry->length == length) {
+            entry->last_used = ++env_cache_counter;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Copy an environment into one block: the pointers, then the strings
+ * (length bytes in all).
+ */
+static char **
+copy_env(char **env, uint32_t envc, size_t length)
+{
+    char **copy = xmalloc((envc + 1) * sizeof(char*) + length);
+    char *p = (char *) (copy + envc + 1);
+    for (uint32_t i = 0; i < envc; i++) {
+        size_t len = strlen(env[i]) + 1;
+        memcpy(p, env[i], len);
+        copy[i] = p;
+        p += len;
+    }
+    copy[envc] = NULL;
+    return copy;
+}
+
+/* Remember an environment, replacing the least recently used.
+ * The strings (length bytes in all) are contiguous, starting at env[0].
+ */
+static char **
+env_cache_add(char **env, uint32_t envc, size_t length)
+{
+    uint64_t digest = string_array_digest(env);
+    struct env_cache_entry *entry = env_cache_find(digest, envc, length);
+    if (entry != NULL
+        && (envc == 0 || memcmp(entry->env[0], env[0], length) == 0))
+        return entry->env;
+    if (entry == NULL) {
+        entry = &env_cache[0];
+        for (int i = 1; i < ENV_CACHE_SIZE; i++) {
+            if (env_cache[i].last_used < entry->last_used)
+                entry = &env_cache[i];
+        }
+    } // else a different environment with the same digest: replace it
+    free(entry->env);
+    char **copy = copy_env(env, envc, length);
+    entry->digest = digest;
+    entry->envc = envc;
+    entry->length = length;
+    entry->env = copy;
+    entry->last_used = ++env_cache_counter;
+    return copy;
+}
+
+static uint64_t
+get_be(const unsigned char *p, int n)
+{
+    uint64_t v = 0;
+    while (--n >= 0)
+        v = (v << 8) | *p++;
+    return v;
+}
+
+/* Run a command received on the command connection cclient
+ * (see CMD_PROTOCOL_VERSION).  The strings (in the message) are used
+ * in place.  fd_out and fd_err are the standard output and error of
+ * the client, or -1 if they were not sent.  Returns the exit code for
+ * the client, or sets *need_env if the client must send its environment.
+ */
+static int
+run_cmd_message(char *msg, size_t mlen, struct cmd_client *cclient,
+                int fd_out, int fd_err, struct lws *wsi, bool *need_env)
+{
+    const unsigned char *umsg = (const unsigned char *) msg;
+    if (mlen < CMD_HEADER_LENGTH || umsg[0] != CMD_PROTOCOL_VERSION) {
+        lwsl_err("bad command from client (version %d)\n",
+                 mlen > 0 ? umsg[0] : -1);
+        return -1;
+    }
+    char kind = msg[1];
+    uint64_t digest = get_be(umsg + 2, 8);
+    uint32_t argc = get_be(umsg + 10, 4);
+    uint32_t envc = get_be(umsg + 14, 4);
+    size_t env_length = get_be(umsg + 18, 4);
+    char *p = msg + CMD_HEADER_LENGTH;
+    char *end = msg + mlen;
+    if (argc > CMD_MAX_MESSAGE || envc > CMD_MAX_MESSAGE)
+        return -1;
+    uint32_t nstrings = 1 + argc + (kind == CMD_ENV_FULL ? envc : 0);
+    char **strings = xmalloc((nstrings + 1) * sizeof(char*));
+    for (uint32_t i = 0; i < nstrings; i++) {
+        char *nul = p >= end ? NULL : memchr(p, '\0', end - p);
+        if (nul == NULL) {
+            free(strings);
+            lwsl_err("bad command from client\n");
+            return -1;
+        }
+        strings[i] = p;
+        p = nul + 1;
+    }
+    strings[nstrings] = NULL;
+    const char *cwd = strings[0];
+    char **argv = strings + 1;
+    char **env;
+    if (kind == CMD_ENV_FULL) {
+        if (env_length != (envc == 0 ? 0 : (size_t) (p - argv[argc]))) {
+            free(strings);
+            lwsl_err("bad command from client\n");
+            return -1;
+        }
+        env = env_cache_add(argv + argc, envc, env_length);
+        // Keep it for the connection, even if it leaves the cache.
+        free(cclient->env);
+        cclient->env = copy_env(env, envc, env_length);
+        cclient->env_digest = digest;
+        cclient->envc = envc;
+        cclient->env_length = env_length;
+    } else if (cclient->env != NULL && cclient->env_digest == digest
+               && cclient->envc == envc
+               && cclient->env_length == env_length) {
+        env = cclient->env;
+    } else {
+        struct env_cache_entry *entry =
+            env_cache_find(digest, envc, env_length);
+        env = entry == NULL ? NULL : entry->env;
+    }
+    argv[argc] = NULL;
+    if (env == NULL) {
+        free(strings);
+        *need_env = true;
+        return 0;
+    }
+    struct options opts;
+    init_options(&opts);
+    if (fd_out >= 0)
+        opts.fd_out = fd_out;
+    if (fd_err >= 0)
+        opts.fd_err = fd_err;
+    optind = 1;
+    process_options(argc, argv, &opts);
+    int ret = handle_command(argc-optind, argv+optind,
+                             cwd, env, wsi, &opts);
+    free(strings);
+    return ret;
+}
+
+/* Read what a command connection sent, keeping any passed fds. */
+static bool
+cmd_read(struct cmd_client *cclient)
+{
+    for (;;) {
+        struct sbuf *rbuf = &cclient->rbuf;
+        sbuf_extend(rbuf, 4096);
+        struct msghdr msg;
+        struct iovec iov;
+        union u { // for alignment
+            char buf[CMSG_SPACE(sizeof(int) * CMD_MAX_FDS)];
+            struct cmsghdr align;
+        } u;
+        msg.msg_control = u.buf;
+        msg.msg_controllen = sizeof u.buf;
+        iov.iov_base = rbuf->buffer + rbuf->len;
+        iov.iov_len = rbuf->size - rbuf->len;
+        msg.msg_name = NULL;
+        msg.msg_namelen = 0;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+        ssize_t n = recvmsg(cclient->socket, &msg, MSG_CMSG_CLOEXEC);
+#else
+        ssize_t n = recvmsg(cclient->socket, &msg, 0);
+#endif
+        if (n < 0)
+            return errno == EAGAIN || errno == EINTR;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET
+                || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *fds = (int *) CMSG_DATA(cmsg);
+            for (int i = 0; i < nfds; i++) {
+                if (cclient->nfds < CMD_MAX_FDS)
+                    cclient->fds[cclient->nfds++] = fds[i];
+                else
+                    close(fds[i]);
+            }
+        }
+        if (n == 0)
+            return false;
+        rbuf->len += n;
+    }
+}
+
+static void
+cmd_close_output(struct cmd_client *cclient)
+{
+    if (cclient->fd_out >= 0) {
+        close(cclient->fd_out);
+        close(cclient->fd_err);
+        cclient->fd_out = -1;
+        cclient->fd_err = -1;
+    }
+}
+
+/* Run the complete commands received on a command connection.
+ * Each is a decimal length and a newline, followed by that many bytes
+ * of message (see CMD_PROTOCOL_VERSION).  The client's output and
+ * error fds are sent with the first message; a connection may then
+ * send any number of messages (see "domterm batch"), each answered
+ * in order.
+ */
+static bool
+cmd_run_received(struct lws *wsi, struct cmd_client *cclient)
+{
+    struct sbuf *rbuf = &cclient->rbuf;
+    size_t start = 0;
+    bool ok = true;
+    while (start < rbuf->len) {
+        char *header = rbuf->buffer + start;
+        char *nl = memchr(header, '\n', rbuf->len - start);
+        if (nl == NULL) {
+            if (rbuf->len - start > 20)
+                ok = false; // not a length
+            break;
+        }
+        char *end;
+        unsigned long mlen = strtoul(header, &end, 10);
+        if (end != nl || mlen > CMD_MAX_MESSAGE) {
+            ok = false;
+            break;
+        }
+        size_t mstart = nl + 1 - rbuf->buffer;
+        if (rbuf->len - mstart < mlen) {
+            sbuf_extend(rbuf, mlen + 1);
+            break;
+        }
+        char *mbuf = rbuf->buffer + mstart;
+        if (cclient->nfds >= 2) {
+            // A new pair of output and error fds, for this message
+            // and any following messages that don't send their own.
+            cmd_close_output(cclient);
+            cclient->fd_out = cclient->fds[0];
+            cclient->fd_err = cclient->fds[1];
+            cclient->nfds -= 2;
+            memmove(cclient->fds, cclient->fds + 2,
+                    cclient->nfds * sizeof(int));
+        }
+        // Commands close their output when done, so give each a copy.
+        int fd_out = -1, fd_err = -1;
+        if (cclient->fd_out >= 0) {
+            fd_out = fcntl(cclient->fd_out, F_DUPFD_CLOEXEC, 0);
+            fd_err = fcntl(cclient->fd_err, F_DUPFD_CLOEXEC, 0);
+        }
+        bool need_env = false;
+        int ret = run_cmd_message(mbuf, mlen, cclient, fd_out, fd_err,
+                                  wsi, &need_env);
+        close_fd_copy(fd_out, cclient->fd_out);
+        close_fd_copy(fd_err, cclient->fd_err);
+        char reply[2];
+        if (need_env) {
+            reply[0] = CMD_REPLY_NEED_ENV;
+            reply[1] = 0;
+        } else {
+            reply[0] = CMD_REPLY_RESULT;
+            reply[1] = (char) ret;
+        }
+        if (write(cclient->socket, reply, 2) != 2)
+            lwsl_err("write failed\n");
+        start = mstart + mlen;
+    }
+    rbuf->len -= start;
+    memmove(rbuf->buffer, rbuf->buffer + start, rbuf->len);
+    return ok;
+}
+
+// The connection being adopted by this thread (see cmd_accept).
+static __thread struct cmd_client *adopting_cmd = NULL;
+
+/* Accept connections to the command socket.
+ * Each is adopted as its own wsi, so a slow client only delays itself.
+ */
+static void
+cmd_accept(struct cmd_client *listener)
+{
+    for (;;) {
+        struct sockaddr sa;
+        socklen_t slen = sizeof sa;
+#if defined(SOCK_CLOEXEC) && defined(SOCK_NONBLOCK)
+        int sockfd = accept4(listener->socket, &sa, &slen,
+                             SOCK_CLOEXEC|SOCK_NONBLOCK);
+#else
+        int sockfd = accept(listener->socket, &sa, &slen);
+        if (sockfd >= 0) {
+            fcntl(sockfd, F_SETFD, FD_CLOEXEC);
+            setblocking(sockfd, 0);
+        }
+#endif
+        if (sockfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                lwsl_err("accept: %s\n", strerror(errno));
+            if (errno != EINTR)
+                return;
+            continue;
+        }
+        // Initialized by the adopt callback, as in spawn_pty.
+        struct cmd_client init;
+        init.socket = sockfd;
+        init.connection = true;
+        sbuf_init(&init.rbuf);
+        init.nfds = 0;
+        init.fd_out = -1;
+        init.fd_err = -1;
+        init.env = NULL;
+        lws_sock_file_fd_type fd;
+        fd.filefd = sockfd;
+        adopting_cmd = &init;
+        int depth = service_unlock_all();
+        struct lws *cwsi = lws_adopt_descriptor_vhost(vhost, 0, fd, "cmd", NULL);
+        service_relock(depth);
+        adopting_cmd = NULL;
+        if (cwsi == NULL)
+            close(sockfd);
+    }
+}
+
 int
 callback_cmd(struct lws *wsi, enum lws_callback_reasons reason,
              void *user, void *in, size_t len) {
     struct cmd_client *cclient = (struct cmd_client *) user;
-    int socket;
+    // Until initialized (by the adopt callback, or by the server for
+    // the listening socket), the cclient is all zeros.
+    if (cclient != NULL && cclient->socket == 0 && ! cclient->connection
+        && reason != LWS_CALLBACK_RAW_ADOPT_FILE)
+        return 0;
     switch (reason) {
-        case LWS_CALLBACK_RAW_RX_FILE:
-            socket = cclient->socket;
-            //fprintf(stderr, "callback_cmd RAW_RX reason:%d socket:%d getpid:%d\n", (int) reason, socket, getpid());
-            struct sockaddr sa;
-            socklen_t slen = sizeof sa;
-#ifdef SOCK_CLOEXEC
-            int sockfd = accept4(socket, &sa, &slen, SOCK_CLOEXEC);
-#else
-            int sockfd = accept(socket, &sa, &slen);
-#endif
-            size_t jblen = 512;
-            char *jbuf = xmalloc(jblen);
-            int jpos = 0;
-            struct options opts;
-            init_options(&opts);
-            for (;;) {
-                if (jblen-jpos < 512) {
-                    jblen = (3 * jblen) >> 1;
-                    jbuf = xrealloc(jbuf, jblen);
-                }
-                struct msghdr msg;
-                struct iovec iov;
-                int myfds[2];
-                union u { // for alignment
-                    char buf[CMSG_SPACE(sizeof myfds)];
-                    struct cmsghdr align;
-                } u;
-                msg.msg_control = u.buf;
-                msg.msg_controllen = sizeof u.buf;
-                struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-                cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 2);
-                iov.iov_base = jbuf+jpos;
-                iov.iov_len = jblen-jpos;
-                msg.msg_name = NULL;
-                msg.msg_namelen = 0;
-                msg.msg_iov = &iov;
-                msg.msg_iovlen = 1;
-                msg.msg_flags = 0;
-                ssize_t n = recvmsg(sockfd, &msg, 0);
-                if (msg.msg_controllen > 0) {
-                    memcpy(myfds, CMSG_DATA(cmsg), 2*sizeof(int));
-                    opts.fd_out = myfds[0];
-                    opts.fd_err = myfds[1];
-                }
-                if (n <= 0) {
-                  break;
-                } else if (jbuf[jpos+n-1] == '\f') {
-                  jpos += n-1;
-                  break;
-                }
-                jpos += n;
-            }
-            jbuf[jpos] = 0;
-            //fprintf(stderr, "from-client: %d bytes '%.*s'\n", jpos, jpos, jbuf);
-            struct json_object *jobj
-              = json_tokener_parse(jbuf);
-            if (jobj == NULL)
-              fatal("json parse fail");
-            struct json_object *jcwd = NULL;
-            struct json_object *jargv = NULL;
-            struct json_object *jenv = NULL;
-            const char *cwd = NULL;
-            // if (!json_object_object_get_ex(jobj, "cwd", &jcwd))
-            //   fatal("jswon no cwd");
-            int argc = -1;
-            char **argv = NULL;
-            char **env = NULL;
-            if (json_object_object_get_ex(jobj, "cwd", &jcwd)
-                && (cwd = strdup(json_object_get_string(jcwd))) != NULL) {
+        case LWS_CALLBACK_RAW_ADOPT_FILE:
+            if (adopting_cmd != NULL) {
+                *cclient = *adopting_cmd;
+                adopting_cmd = NULL;
             }
-            if (json_object_object_get_ex(jobj, "argv", &jargv)) {
-                argc = json_object_array_length(jargv);
-                argv = xmalloc(sizeof(char*) * (argc+1));
-                for (int i = 0; i <argc; i++) {
-                  argv[i] = strdup(json_object_get_string(json_object_array_get_idx(jargv, i)));
-                }
-                argv[argc] = NULL;
+            break;
+        case LWS_CALLBACK_RAW_RX_FILE:
+            //fprintf(stderr, "callback_cmd RAW_RX reason:%d socket:%d getpid:%d\n", (int) reason, cclient->socket, getpid());
+            if (! cclient->connection) {
+                cmd_accept(cclient);
+                break;
             }
-            if (json_object_object_get_ex(jobj, "env", &jenv)) {
-                int nenv = json_object_array_length(jenv);
-                env = xmalloc(sizeof(char*) * (nenv+1));
-                for (int i = 0; i <nenv; i++) {
-                  env[i] = strdup(json_object_get_string(json_object_array_get_idx(jenv, i)));
-                }
-                env[nenv] = NULL;
+            bool more = cmd_read(cclient);
+            if (! cmd_run_received(wsi, cclient) || ! more)
+                return -1;
+            break;
+        case LWS_CALLBACK_RAW_CLOSE_FILE:
+            if (cclient->connection) {
+                close(cclient->socket);
+                while (cclient->nfds > 0)
+                    close(cclient->fds[--cclient->nfds]);
+                cmd_close_output(cclient);
+                sbuf_free(&cclient->rbuf);
+                free(cclient->env);
             }
-            json_object_put(jobj);
-            optind = 1;
-            process_options(argc, argv, &opts);
-            int ret = handle_command(argc-optind, argv+optind,
-                                     cwd, env, wsi, &opts);
-            close(opts.fd_out);
-            close(opts.fd_err);
-            char r = (char) ret;
-            if (write(sockfd, &r, 1) != 1)
-                lwsl_err("write failed\n");
-            close(sockfd);
-            // FIXME: free argv, cwd, env
             break;
     default:
       //fprintf(stderr, "callback_cmd default reason:%d\n", (int) reason);
@@ -1516,32 +3436,173 @@ callback_cmd(struct lws *wsi, enum lws_callback_reasons reason,
     return 0;
 }
 
+/** True if reading from a session's pty should pause, because no live
+ * window has room in its window.  However, in flood mode the output is
+ * dropped, and without windows it goes to the spool (or just the
+ * screen), so keep reading.
+ */
+static bool
+pty_should_pause(struct pty_client *pclient, int *live_clients)
+{
+    long max_room = output_room(pclient, live_clients);
+    if (pclient->flooding || should_drain(pclient))
+        return false;
+    return max_room <= 0 || pclient->paused;
+}
+
+/** Handle n bytes of output just read from a session's pty into
+ * the free space of its output ring.  In packet mode, pcmd is the
+ * packet status byte.
+ */
+static void
+pty_output(struct pty_client *pclient, char pcmd, ssize_t n,
+           int live_clients)
+{
+    struct lws *wsclient_wsi;
+    struct ring *output = pclient->output;
+    if (pclient->packet_mode && n >= 0) {
+#if USE_PTY_PACKET_MODE && TIOCPKT_IOCTL
+        bool modes_changed = n == 0 && (pcmd & TIOCPKT_IOCTL) != 0;
+        struct termios *tio;
+        if (modes_changed)
+            pclient->termios_valid = false;
+        if (modes_changed && (tio = pty_termios(pclient)) != NULL) {
+            const char* icanon_str = (tio->c_lflag & ICANON) != 0 ? "icanon" :  "-icanon";
+            const char* echo_str = (tio->c_lflag & ECHO) != 0 ? "echo" :  "-echo";
+            const char* extproc_str = "";
+#if EXTPROC
+            if ((tio->c_lflag & EXTPROC) != 0)
+                extproc_str = " extproc";
+#endif
+            FOREACH_WSCLIENT(wsclient_wsi, pclient) {
+                struct tty_client *tclient =
+                    (struct tty_client *) lws_wsi_user(wsclient_wsi);
+                printf_to_browser(tclient,
+                                  URGENT_WRAP("\033]71; %s %s%s lflag:%x\007"),
+                                  icanon_str, echo_str,
+                                  extproc_str, tio->c_lflag);
+                request_writable(wsclient_wsi);
+            }
+        }
+#endif
+    }
+    if (n > 0) {
+        if (! termios_reported(pclient))
+            pclient->termios_valid = false;
+        if (pclient->screen != NULL) {
+            long pos = output->end;
+            while (pos < output->end + n) {
+                char *data;
+                size_t len = ring_span(output, pos, output->end + n,
+                                       &data);
+                screen_feed(pclient->screen, data, len);
+                pos += len;
+            }
+        }
+#if USE_LWS_TIMER
+        if (pclient->flooding) {
+            // Only the screen model sees this output;
+            // windows get it in the next frame.
+            flood_check(pclient, n);
+            return;
+        }
+        flood_check(pclient, n);
+#endif
+        output->end += n;
+        long lag_limit = main_options->lag_limit;
+        FOREACH_WSCLIENT(wsclient_wsi, pclient) {
+            struct tty_client *tclient =
+                (struct tty_client *) lws_wsi_user(wsclient_wsi);
+            long unconfirmed =
+                (tclient->sent_count - tclient->confirmed_count) & MASK28;
+            // Detach a window that is too far behind (but
+            // not the last live one) from the live output,
+            // so it doesn't hold back the others.
+            if (lag_limit > 0 && ! tclient->lagging
+                && live_clients > 1
+                && unconfirmed + (output->end - tclient->output_pos)
+                > lag_limit) {
+                lwsl_notice("window %d of session %d lagging - detached from output\n",
+                            tclient->connection_number,
+                            pclient->session_number);
+                tclient->lagging = unconfirmed < 1000 ? 2 : 1;
+                tclient->output_pos = output->end;
+                live_clients--;
+            }
+        }
+        output_ready(pclient, n);
+        trim_output(pclient);
+    }
+}
+
+#if USE_PTY_THREADS
+/** Handle output read by a pty thread (see ptyio.c), which is normally
+ * already in the free space of the output ring.  If data is non-NULL,
+ * the output was read there instead (in flood mode), and is copied.
+ * The length includes the packet status byte pcmd in packet mode;
+ * a length <= 0 means end-of-file or an error.
+ */
+void
+pty_chunk_ready(struct pty_client *pclient, char pcmd,
+                const char *data, ssize_t length)
+{
+    if (length <= 0) {
+        // Close the wsi, which calls pty_destroy.
+        lws_set_timeout(pclient->pty_wsi, PENDING_TIMEOUT_SHUTDOWN_FLUSH,
+                        LWS_TO_KILL_ASYNC);
+        return;
+    }
+    if (pclient->packet_mode)
+        length--;
+    struct ring *output = pclient->output;
+    if (data != NULL) {
+        ring_reserve(output, length);
+        struct iovec iov[2];
+        ring_free_spans(output, iov);
+        size_t first = iov[0].iov_len < length ? iov[0].iov_len : length;
+        memcpy(iov[0].iov_base, data, first);
+        memcpy(iov[1].iov_base, data + first, length - first);
+    }
+    int live_clients;
+    output_room(pclient, &live_clients);
+    pty_output(pclient, pcmd, length, live_clients);
+    if (pty_should_pause(pclient, NULL))
+        pclient->paused = 1;
+    else
+        ptyio_resume(pclient);
+}
+#endif
+
 int
 callback_pty(struct lws *wsi, enum lws_callback_reasons reason,
              void *user, void *in, size_t len) {
     struct pty_client *pclient = (struct pty_client *) user;
+    // Until the adopt callback has run, the pclient is all zeros.
+    if (pclient != NULL && pclient->output == NULL
+        && reason != LWS_CALLBACK_RAW_ADOPT_FILE)
+        return 0;
     switch (reason) {
+        case LWS_CALLBACK_RAW_ADOPT_FILE:
+            if (adopting_pty != NULL) {
+                pty_adopted(wsi, pclient, adopting_pty);
+                adopting_pty = NULL;
+            }
+            break;
+#if USE_SERVICE_THREADS
+        case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+            // Not for a particular session (pclient is NULL).
+            run_thread_requests();
+#if USE_PTY_THREADS
+            ptyio_drain();
+#endif
+            break;
+#endif
         case LWS_CALLBACK_RAW_RX_FILE: {
             //fprintf(stderr, "callback+pty LWS_CALLBACK_RAW_RX_FILE\n");
-            struct lws *wsclient_wsi;
-            long min_unconfirmed = LONG_MAX;
-            int avail = INT_MAX;
-            FOREACH_WSCLIENT(wsclient_wsi, pclient) {
-                struct tty_client *tclient = (struct tty_client *) lws_wsi_user(wsclient_wsi);
-                long unconfirmed =
-                  ((tclient->sent_count - tclient->confirmed_count) & MASK28)
-                  + tclient->ocount;
-                if (unconfirmed < min_unconfirmed)
-                  min_unconfirmed = unconfirmed;
-                int tavail = tclient->ob.size - tclient->ob.len;
-                if (tavail < 1000) {
-                    sbuf_extend(&tclient->ob, 1000);
-                    tavail = tclient->ob.size - tclient->ob.len;
-                }
-                if (tavail < avail)
-                    avail = tavail;
-            }
-            if (min_unconfirmed >= UNCONFIRMED_LIMIT || avail == 0 || pclient->paused) {
+            struct ring *output = pclient->output;
+            note_pty_thread(pclient);
+            int live_clients;
+            if (pty_should_pause(pclient, &live_clients)) {
                 if (! pclient->paused) {
 #if USE_RXFLOW
                     lws_rx_flow_control(wsi, 0|LWS_RXFLOW_REASON_FLAG_PROCESS_NOW);
@@ -1550,83 +3611,72 @@ callback_pty(struct lws *wsi, enum lws_callback_reasons reason,
                 }
                 break;
             }
-            if (avail >= eof_len) {
-                char *data_start = NULL;
-                int data_length = 0, read_length = 0;
-                FOREACH_WSCLIENT(wsclient_wsi, pclient) {
-                    struct tty_client *tclient =
-                        (struct tty_client *) lws_wsi_user(wsclient_wsi);
-                    if (data_start == NULL) {
-                        data_start = tclient->ob.buffer+tclient->ob.len;
-                        ssize_t n;
-                        if (pclient->packet_mode) {
-#if USE_PTY_PACKET_MODE
-                            // We know data_start > obuffer_raw, so
-                            // it's safe to access data_start[-1].
-                            char save_byte = data_start[-1];
-                            n = read(pclient->pty, data_start-1, avail+1);
-                            char pcmd = data_start[-1];
-                            data_start[-1] = save_byte;
-#if TIOCPKT_IOCTL
-                            if (n == 1 && (pcmd & TIOCPKT_IOCTL) != 0) {
-                                struct termios tio;
-                                tcgetattr(pclient->pty, &tio);
-                                const char* icanon_str = (tio.c_lflag & ICANON) != 0 ? "icanon" :  "-icanon";
-                                const char* echo_str = (tio.c_lflag & ECHO) != 0 ? "echo" :  "-echo";
-                                const char* extproc_str = "";
-#if EXTPROC
-                                if ((tio.c_lflag & EXTPROC) != 0)
-                                    extproc_str = " extproc";
-#endif
-                                n = sprintf(data_start,
-                                            URGENT_WRAP("\033]71; %s %s%s lflag:%x\007"),
-                                            icanon_str, echo_str,
-                                            extproc_str, tio.c_lflag);
-                                data_length = n;
-                            }
-                            else
-#endif
-                                read_length = n > 0 ? n - 1 : n;
-#endif
-                        } else {
-                            n = read(pclient->pty, data_start, avail);
-                            read_length = n;
-                        }
-                        data_length += read_length;
-                    } else {
-                        memcpy(tclient->ob.buffer+tclient->ob.len,
-                               data_start, data_length);
-                    }
-                    tclient->ob.len += data_length;
-                    tclient->ocount += read_length;
-                    lws_callback_on_writable(wsclient_wsi);
-                }
-                if (pclient->preserved_output != NULL
-                    && should_backup_output(pclient)) {
-                     size_t needed = pclient->preserved_end + data_length;
-                     if (needed > pclient->preserved_size) {
-                          size_t nsize = (3 * pclient->preserved_size) >> 1;
-                          if (needed > nsize)
-                               nsize = needed;
-                          char * nbuffer = xrealloc(pclient->preserved_output, nsize);
-                          pclient->preserved_output = nbuffer;
-                          pclient->preserved_size = nsize;
-                     }
-                     memcpy(pclient->preserved_output + pclient->preserved_end,
-                            data_start, data_length);
-                     pclient->preserved_end += data_length;
-                }
+            // Read directly into the shared output ring.
+            // In packet mode the first byte read is the packet status.
+            ring_reserve(output, READ_CHUNK);
+            struct iovec iov[3];
+            char pcmd = 0;
+            int niov = 0;
+            if (pclient->packet_mode) {
+                iov[0].iov_base = &pcmd;
+                iov[0].iov_len = 1;
+                niov = 1;
             }
+            niov += ring_free_spans(output, &iov[niov]);
+            ssize_t n = readv(pclient->pty, iov, niov);
+            if (pclient->packet_mode && n > 0)
+                n--;
+            pty_output(pclient, pcmd, n, live_clients);
         }
         break;
+#if USE_LWS_TIMER
+        case LWS_CALLBACK_TIMER:
+            note_pty_thread(pclient);
+            if (pclient->flush_pending)
+                flush_output(pclient);
+            if (pclient->flooding) {
+                flood_check(pclient, 0);
+            }
+            if (pclient->flooding) {
+                // Skip a frame if no window could take it now.
+                if (output_room(pclient, NULL) > 0)
+                    flood_frame(pclient);
+                long frame_rate = main_options->frame_rate;
+                lws_set_timer_usecs(wsi,
+                                    1000000 / (frame_rate > 0 ? frame_rate : 1));
+            }
+            break;
+#endif
+        case LWS_CALLBACK_RAW_WRITEABLE_FILE:
+            note_pty_thread(pclient);
+            pty_drain_input(pclient);
+            break;
         case LWS_CALLBACK_RAW_CLOSE_FILE: {
             //fprintf(stderr, "callback_pty LWS_CALLBACK_RAW_CLOSE_FILE\n", reason);
             pclient->eof_seen = 1;
+            // Usually the process has already exited; if not, it
+            // is reaped later (see reaper.c).
+            int status = end_process(pclient->pid, server->options.sig_code);
+            int exit_status = status >= 0 ? exit_code(status) : -1;
+#if USE_LWS_TIMER
+            // Windows wait for the exit status of a process still
+            // running - but not for ever, as the reaper kills it.
+            pid_t waiting_pid = status == -1 ? pclient->pid : 0;
+#else
+            pid_t waiting_pid = 0;
+#endif
             struct lws *wsclient_wsi;
             FOREACH_WSCLIENT(wsclient_wsi, pclient) {
                 struct tty_client *tclient =
                     (struct tty_client *) lws_wsi_user(wsclient_wsi);
-                lws_callback_on_writable(wsclient_wsi);
+                tclient->exit_status = exit_status;
+                if (waiting_pid != 0) {
+                    tclient->waiting_pid = waiting_pid;
+                    tclient->next_exit_waiter = exit_waiters;
+                    exit_waiters = tclient;
+                }
+                request_writable(wsclient_wsi);
+                resume_input(tclient);
                 tclient->pclient = NULL;
             }
             pty_destroy(pclient);
@@ -0,0 +1,307 @@
+/* Optional threads for reading pty output.
+ *
+ * Each session is assigned to the thread with the fewest sessions,
+ * which waits (using epoll) for output on its ptys.  A thread reads
+ * a chunk from a pty and hands it to the lws service thread through
+ * a single-producer single-consumer queue, waking it with
+ * lws_cancel_service.  The service thread handles the chunk (see
+ * pty_chunk_ready) and then re-arms the pty (EPOLLONESHOT), so there
+ * is at most one chunk in flight per pty, and pausing a session just
+ * means not re-arming it.
+ *
+ * The output is read directly into the free space of the session's
+ * output ring, which arm reserves (and pins, so ring_consume doesn't
+ * free it) before handing it to the thread.  Only the service thread
+ * updates the ring's positions.  The exception is flood mode, when
+ * flood_frame may append to the ring while a read is in flight: then
+ * the thread reads into a buffer of the chunk instead.
+ */
+
+#include "server.h"
+
+#if USE_PTY_THREADS
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define PTY_CHUNK_SIZE 16384 // at least this much free space is reserved
+// Chunks queued per thread (a power of 2).  At most one chunk per
+// session is in flight, so this is only reached with many sessions.
+#define PTY_QUEUE_SIZE 1024
+
+struct pty_worker {
+    pthread_t thread;
+    int epoll_fd;
+    int stop_fd; // eventfd, to stop the thread
+    int nsessions;
+    struct spsc_queue ready; // chunks read, for the service thread
+};
+
+struct pty_chunk {
+    struct pty_client *pclient; // NULL if the session is gone
+    struct pty_worker *worker;
+    int fd; // a dup of the pty, only read by the worker thread
+    bool in_flight; // armed or being read (as seen by the service thread)
+    struct ring *output; // pinned while reading into it, else NULL
+    struct iovec iov[3]; // where to read
+    int niov;
+    char pcmd; // the packet status byte, in packet mode
+    char *buffer; // read into while flooding (NULL until needed)
+    ssize_t length; // result of read
+    struct pty_chunk *next_orphan;
+};
+
+static struct pty_worker *workers;
+static int nworkers = 0;
+static int wake_pending = 0; // set when lws_cancel_service was called
+// Chunks of destroyed sessions, still owned by a thread.
+static struct pty_chunk *orphans = NULL;
+
+static void *
+worker_run(void *arg)
+{
+    struct pty_worker *worker = (struct pty_worker *) arg;
+    struct epoll_event events[16];
+    for (;;) {
+        int n = epoll_wait(worker->epoll_fd, events, 16, -1);
+        bool queued = false;
+        for (int i = 0; i < n; i++) {
+            struct pty_chunk *chunk = events[i].data.ptr;
+            if (chunk == NULL)
+                return NULL;
+            ssize_t r;
+            do {
+                r = readv(chunk->fd, chunk->iov, chunk->niov);
+            } while (r < 0 && errno == EINTR);
+            if (r < 0 && errno == EAGAIN) {
+                // The pty is non-blocking (for writing input); wait again.
+                struct epoll_event ev;
+                ev.events = EPOLLIN|EPOLLONESHOT;
+                ev.data.ptr = chunk;
+                epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, chunk->fd, &ev);
+                continue;
+            }
+            chunk->length = r;
+            while (! spsc_push(&worker->ready, chunk))
+                sched_yield();
+            queued = true;
+        }
+        if (queued && ! __atomic_exchange_n(&wake_pending, 1, __ATOMIC_ACQ_REL))
+            lws_cancel_service(context);
+    }
+}
+
+/* Start count pty threads, once the server is running (and daemonized). */
+void
+ptyio_start(int count)
+{
+    if (count <= 0)
+        return;
+    workers = xmalloc(count * sizeof(struct pty_worker));
+    // Signals are handled by the main thread.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 0; i < count; i++) {
+        struct pty_worker *worker = &workers[nworkers];
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        worker->stop_fd = eventfd(0, EFD_CLOEXEC);
+        worker->nsessions = 0;
+        spsc_init(&worker->ready, PTY_QUEUE_SIZE);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (worker->epoll_fd < 0 || worker->stop_fd < 0
+            || epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD,
+                         worker->stop_fd, &ev) != 0
+            || pthread_create(&worker->thread, NULL,
+                              worker_run, worker) != 0) {
+            lwsl_err("cannot start pty thread: %s\n", strerror(errno));
+            break;
+        }
+        nworkers++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    lwsl_notice("started %d pty threads\n", nworkers);
+    // Sessions may have been started by the initial command.
+    for (struct pty_client *pclient = pty_client_list;
+         pclient != NULL; pclient = pclient->next_pty_client) {
+        if (ptyio_add(pclient))
+            lws_rx_flow_control(pclient->pty_wsi, 0);
+    }
+}
+
+static void
+unpin(struct pty_chunk *chunk)
+{
+    if (chunk->output != NULL) {
+        chunk->output->pinned--;
+        ring_unref(chunk->output);
+        chunk->output = NULL;
+    }
+}
+
+static void
+free_chunk(struct pty_chunk *chunk)
+{
+    unpin(chunk);
+    close(chunk->fd);
+    free(chunk->buffer);
+    free(chunk);
+}
+
+/* Stop the threads, and free their resources,
+ * before the lws context is destroyed. */
+void
+ptyio_stop(void)
+{
+    for (int i = 0; i < nworkers; i++) {
+        uint64_t one = 1;
+        if (write(workers[i].stop_fd, &one, sizeof(one)) != sizeof(one))
+            lwsl_err("cannot stop pty thread\n");
+    }
+    for (int i = 0; i < nworkers; i++)
+        pthread_join(workers[i].thread, NULL);
+    while (orphans != NULL) {
+        struct pty_chunk *chunk = orphans;
+        orphans = chunk->next_orphan;
+        free_chunk(chunk);
+    }
+    for (struct pty_client *pclient = pty_client_list;
+         pclient != NULL; pclient = pclient->next_pty_client) {
+        if (pclient->chunk != NULL) {
+            free_chunk(pclient->chunk);
+            pclient->chunk = NULL;
+        }
+    }
+    for (int i = 0; i < nworkers; i++) {
+        close(workers[i].epoll_fd);
+        close(workers[i].stop_fd);
+        spsc_free(&workers[i].ready);
+    }
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+}
+
+/* Have the chunk's thread read the next output of its session. */
+static void
+arm(struct pty_chunk *chunk, int op)
+{
+    struct pty_client *pclient = chunk->pclient;
+    int niov = 0;
+    if (pclient->packet_mode) {
+        chunk->iov[0].iov_base = &chunk->pcmd;
+        chunk->iov[0].iov_len = 1;
+        niov = 1;
+    }
+    if (pclient->flooding) {
+        if (chunk->buffer == NULL)
+            chunk->buffer = xmalloc(PTY_CHUNK_SIZE);
+        chunk->iov[niov].iov_base = chunk->buffer;
+        chunk->iov[niov].iov_len = PTY_CHUNK_SIZE;
+        niov++;
+    } else {
+        struct ring *output = pclient->output;
+        ring_reserve(output, PTY_CHUNK_SIZE);
+        niov += ring_free_spans(output, &chunk->iov[niov]);
+        chunk->output = ring_ref(output);
+        output->pinned++;
+    }
+    chunk->niov = niov;
+    struct epoll_event ev;
+    ev.events = EPOLLIN|EPOLLONESHOT;
+    ev.data.ptr = chunk;
+    if (epoll_ctl(chunk->worker->epoll_fd, op, chunk->fd, &ev) != 0) {
+        lwsl_err("epoll_ctl pty: %s\n", strerror(errno));
+        unpin(chunk);
+    } else
+        chunk->in_flight = true;
+}
+
+/** Have a pty thread read the output of a new session.
+ * Returns false (and does nothing) if there are no pty threads.
+ */
+bool
+ptyio_add(struct pty_client *pclient)
+{
+    if (nworkers == 0)
+        return false;
+    struct pty_worker *worker = &workers[0];
+    for (int i = 1; i < nworkers; i++) {
+        if (workers[i].nsessions < worker->nsessions)
+            worker = &workers[i];
+    }
+    struct pty_chunk *chunk = xmalloc(sizeof(struct pty_chunk));
+    chunk->pclient = pclient;
+    chunk->worker = worker;
+    chunk->in_flight = false;
+    chunk->output = NULL;
+    chunk->buffer = NULL;
+    chunk->fd = fcntl(pclient->pty, F_DUPFD_CLOEXEC, 0);
+    if (chunk->fd < 0) {
+        free(chunk);
+        return false;
+    }
+    worker->nsessions++;
+    pclient->chunk = chunk;
+    arm(chunk, EPOLL_CTL_ADD);
+    return true;
+}
+
+/* Read more output, unless already reading. */
+void
+ptyio_resume(struct pty_client *pclient)
+{
+    struct pty_chunk *chunk = pclient->chunk;
+    if (chunk != NULL && ! chunk->in_flight)
+        arm(chunk, EPOLL_CTL_MOD);
+}
+
+/* Stop reading a session's output (when it is destroyed). */
+void
+ptyio_remove(struct pty_client *pclient)
+{
+    struct pty_chunk *chunk = pclient->chunk;
+    if (chunk == NULL)
+        return;
+    pclient->chunk = NULL;
+    chunk->worker->nsessions--;
+    if (chunk->in_flight) {
+        // The thread still owns it; ptyio_drain frees it.
+        chunk->pclient = NULL;
+        chunk->next_orphan = orphans;
+        orphans = chunk;
+    } else
+        free_chunk(chunk);
+}
+
+/* Handle the chunks read by the pty threads.
+ * Called in the service thread on LWS_CALLBACK_EVENT_WAIT_CANCELLED.
+ */
+void
+ptyio_drain(void)
+{
+    __atomic_store_n(&wake_pending, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < nworkers; i++) {
+        struct pty_chunk *chunk;
+        while ((chunk = spsc_pop(&workers[i].ready)) != NULL) {
+            chunk->in_flight = false;
+            if (chunk->pclient == NULL) {
+                struct pty_chunk **p = &orphans;
+                while (*p != chunk)
+                    p = &(*p)->next_orphan;
+                *p = chunk->next_orphan;
+                free_chunk(chunk);
+            } else {
+                // Output read into the buffer (rather than the ring)
+                // is passed separately.
+                char *data = chunk->output == NULL ? chunk->buffer : NULL;
+                unpin(chunk);
+                pty_chunk_ready(chunk->pclient, chunk->pcmd,
+                                data, chunk->length);
+            }
+        }
+    }
+}
+#endif
@@ -0,0 +1,207 @@
+/* Waiting for the processes of closed sessions to exit.
+ *
+ * When a session's pty is closed, its process is sent the --signal
+ * (SIGHUP by default).  If it has not exited yet, it is reaped later,
+ * without blocking the service thread: a SIGCHLD handler writes to a
+ * pipe that is read in the lws event loop, which then checks the
+ * waiting processes with waitpid(WNOHANG).  A process that ignores
+ * the signal is sent SIGTERM, and then SIGKILL (if lws has timers).
+ */
+
+#include "server.h"
+
+// Seconds to wait before sending SIGTERM, and then SIGKILL.
+#define REAP_ESCALATE_SECONDS 3
+
+struct dying_process {
+    struct dying_process *next;
+    pid_t pid;
+    int stage; // 0: sent the --signal; 1: sent SIGTERM; 2: sent SIGKILL
+    int64_t deadline; // when to go to the next stage, in microseconds
+};
+
+static struct dying_process *dying_processes = NULL;
+static int reaper_pipe[2] = { -1, -1 };
+static struct lws *reaper_wsi = NULL;
+
+static int64_t
+reaper_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+sigchld_handler(int sig)
+{
+    int saved_errno = errno;
+    char ch = 0;
+    if (write(reaper_pipe[1], &ch, 1) < 0) {
+        // The pipe is full, so the event loop will look anyway.
+    }
+    errno = saved_errno;
+}
+
+/* Set up the pipe and the SIGCHLD handler, on first use. */
+static bool
+reaper_init(void)
+{
+    if (reaper_wsi != NULL)
+        return true;
+    if (reaper_pipe[0] < 0) {
+        if (pipe(reaper_pipe) != 0) {
+            lwsl_err("reaper pipe: %s\n", strerror(errno));
+            return false;
+        }
+        for (int i = 0; i < 2; i++) {
+            fcntl(reaper_pipe[i], F_SETFD, FD_CLOEXEC);
+            setblocking(reaper_pipe[i], 0);
+        }
+        struct sigaction act;
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = sigchld_handler;
+        act.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+        sigemptyset(&act.sa_mask);
+        sigaction(SIGCHLD, &act, NULL);
+    }
+    lws_sock_file_fd_type fd;
+    fd.filefd = reaper_pipe[0];
+    int depth = service_unlock_all();
+    reaper_wsi = lws_adopt_descriptor_vhost(vhost, 0, fd, "reaper", NULL);
+    service_relock(depth);
+    return reaper_wsi != NULL;
+}
+
+/** The exit code of a process, from its wait status, as a shell
+ * reports it: 128 plus the signal number if it was killed by a signal.
+ */
+int
+exit_code(int status)
+{
+    return WIFEXITED(status) ? WEXITSTATUS(status)
+        : WIFSIGNALED(status) ? 128 + WTERMSIG(status) : -1;
+}
+
+static void
+report_exit(pid_t pid, int status)
+{
+    if (WIFSIGNALED(status))
+        lwsl_notice("process killed by signal %d, pid: %d\n",
+                    WTERMSIG(status), pid);
+    else
+        lwsl_notice("process exited with code %d, pid: %d\n",
+                    exit_code(status), pid);
+}
+
+/* Reap the processes that exited, and signal the ones taking too long. */
+static void
+check_dying_processes(void)
+{
+    int64_t now = reaper_now();
+    int64_t next_deadline = 0;
+    struct dying_process **p = &dying_processes;
+    while (*p != NULL) {
+        struct dying_process *dp = *p;
+        int status;
+        pid_t r;
+        while ((r = waitpid(dp->pid, &status, WNOHANG)) == -1
+               && errno == EINTR)
+            ;
+        if (r != 0) {
+            pid_t pid = dp->pid;
+            *p = dp->next;
+            free(dp);
+            if (r == pid) {
+                report_exit(pid, status);
+                process_exited(pid, status);
+            } else
+                process_exited(pid, -1);
+            continue;
+        }
+        if (dp->stage < 2 && now >= dp->deadline) {
+            dp->stage++;
+            int sig = dp->stage == 1 ? SIGTERM : SIGKILL;
+            lwsl_notice("sending %d to process %d\n", sig, dp->pid);
+            kill(dp->pid, sig);
+            dp->deadline = now + REAP_ESCALATE_SECONDS * 1000000;
+        }
+        if (dp->stage < 2
+            && (next_deadline == 0 || dp->deadline < next_deadline))
+            next_deadline = dp->deadline;
+        p = &dp->next;
+    }
+#if USE_LWS_TIMER
+    if (next_deadline != 0 && reaper_wsi != NULL)
+        lws_set_timer_usecs(reaper_wsi, next_deadline - now);
+#endif
+}
+
+/** Ask the process of a closed session to exit.
+ * Returns its wait status if it has already exited.  Otherwise
+ * returns -1, and the process is reaped when it does exit, at which
+ * point process_exited is called; or returns -2 if it cannot be
+ * waited for.
+ */
+int
+end_process(pid_t pid, int sig)
+{
+    lwsl_notice("sending %d to process %d\n", sig, pid);
+    if (kill(pid, sig) != 0) {
+        lwsl_err("kill: pid: %d, errno: %d (%s)\n", pid, errno, strerror(errno));
+    }
+    int status;
+    pid_t r;
+    while ((r = waitpid(pid, &status, WNOHANG)) == -1 && errno == EINTR)
+        ;
+    if (r == pid) {
+        report_exit(pid, status);
+        return status;
+    }
+    if (r < 0)
+        return -2;
+    if (! reaper_init()) {
+        // Can't wait in the event loop; block as a last resort.
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+            ;
+        report_exit(pid, status);
+        return status;
+    }
+    struct dying_process *dp = xmalloc(sizeof(struct dying_process));
+    dp->pid = pid;
+    dp->stage = 0;
+    dp->deadline = reaper_now() + REAP_ESCALATE_SECONDS * 1000000;
+    dp->next = dying_processes;
+    dying_processes = dp;
+    // The reaper_wsi may belong to another service thread;
+    // have it (re)start its timer.
+    sigchld_handler(SIGCHLD);
+    return -1;
+}
+
+int
+callback_reaper(struct lws *wsi, enum lws_callback_reasons reason,
+                void *user, void *in, size_t len)
+{
+    switch (reason) {
+    case LWS_CALLBACK_RAW_RX_FILE: {
+        char buf[64];
+        while (read(reaper_pipe[0], buf, sizeof(buf)) > 0)
+            ;
+        check_dying_processes();
+        break;
+    }
+#if USE_LWS_TIMER
+    case LWS_CALLBACK_TIMER:
+        check_dying_processes();
+        break;
+#endif
+    case LWS_CALLBACK_RAW_CLOSE_FILE:
+        if (wsi == reaper_wsi)
+            reaper_wsi = NULL;
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
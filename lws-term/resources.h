@@ -0,0 +1,36 @@
+#ifndef RESOURCES_H
+#define RESOURCES_H
+
+#include <stdint.h>
+
+/** A file compiled into the executable.
+ * The resources.c file is generated at build time by mkresources.
+ */
+struct resource {
+  char *name;
+  unsigned char *data;
+  unsigned int length;
+  unsigned char *gzip_data; // NULL if compressing doesn't help
+  unsigned int gzip_length;
+  char *etag; // a strong (quoted) ETag, from a hash of data
+};
+extern struct resource resources[];
+
+/* A perfect hash index of resources: the resource named name (if any)
+ * is resources[resource_index[resource_hash(name, resource_hash_seed)
+ * & resource_index_mask]], and unused slots are -1.
+ */
+extern short resource_index[];
+extern unsigned int resource_index_mask;
+extern uint32_t resource_hash_seed;
+
+static inline uint32_t
+resource_hash(const char *name, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ seed;
+    while (*name)
+        h = (h ^ (unsigned char) *name++) * 16777619u;
+    return h;
+}
+
+#endif
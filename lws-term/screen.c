@@ -0,0 +1,1398 @@
+/* A headless terminal screen model - see screen.h. */
+
+#include "server.h"
+#include "screen.h"
+
+#define SCREEN_MAX_PARAMS 16
+#define SCREEN_MAX_OSC 4096
+
+// The ch of the second (right) cell of a double-width character.
+#define WIDE_CONT 0
+
+#define ATTR_BOLD       0x01
+#define ATTR_DIM        0x02
+#define ATTR_ITALIC     0x04
+#define ATTR_UNDERLINE  0x08
+#define ATTR_BLINK      0x10
+#define ATTR_INVERSE    0x20
+#define ATTR_INVISIBLE  0x40
+#define ATTR_STRIKE     0x80
+
+// A color is 0 (default), 1+index for an indexed color (0..255),
+// or COLOR_RGB|0xRRGGBB.
+#define COLOR_RGB 0x1000000
+
+struct attr {
+    uint32_t fg, bg;
+    uint16_t flags;
+};
+
+struct cell {
+    uint32_t ch;
+    struct attr attr;
+};
+
+struct line {
+    struct cell *cells;
+    int len;  // cells in use; cells after that are default blanks
+    int size; // cells allocated
+    bool wrapped; // continues on the next line (auto-wrap)
+    bool dirty; // changed since the last delta
+};
+
+struct cursor {
+    int x, y;
+    struct attr attr;
+    bool origin;
+    int charset;
+};
+
+enum parse_state {
+    S_GROUND,
+    S_ESC,
+    S_ESC_CHARSET, // after ESC ( - designate G0
+    S_ESC_SKIP,    // skip one more character
+    S_CSI,
+    S_OSC,
+    S_STRING,      // DCS, SOS, PM, APC - ignored
+    S_STRING_ESC   // ESC in OSC or STRING - expecting '\\'
+};
+
+/** State that is not part of the screen contents. */
+struct modes {
+    int top, bottom; // scroll region: first row, and last row + 1
+    int charset; // G0: 0 for ASCII, 1 for DEC special graphics
+    bool autowrap;
+    bool origin;
+    bool insert;
+    bool cursor_visible;
+    bool app_cursor;
+    bool app_keypad;
+    bool bracketed_paste;
+    bool focus_events;
+    int mouse_mode;     // 0, 1000, 1002, or 1003
+    int mouse_encoding; // 0, 1005, 1006, or 1015
+};
+
+struct screen {
+    int rows, cols;
+    struct line *lines;      // rows lines of the active buffer
+    struct line *main_lines; // main buffer, while alternate is active
+    bool alternate;
+    struct cursor main_cursor; // main cursor, while alternate is active
+
+    // Lines scrolled off the top of the main buffer, oldest first,
+    // in a circular buffer.
+    struct line *history;
+    int history_max, history_start, history_count;
+
+    int x, y;
+    bool pending_wrap; // a character was written in the last column
+    struct attr attr;
+    struct cursor saved;
+    uint32_t last_char;
+    char *title;
+    struct modes m;
+
+    // For screen_delta: changes since the last snapshot or delta.
+    int scrolled; // lines added to history
+    bool redraw; // all lines need to be sent
+    bool title_changed;
+    bool sent_alternate;
+    bool alternate_left; // switched back to the main buffer
+    struct modes sent_modes;
+    int sent_x, sent_y;
+    struct attr sent_attr;
+
+    enum parse_state state;
+    int params[SCREEN_MAX_PARAMS];
+    int nparams;
+    char private_marker; // '?', '>', '=', or '<' at start of CSI
+    char intermediate;
+    struct sbuf osc;
+    uint32_t utf8_char;
+    int utf8_pending; // continuation bytes still expected
+};
+
+static const struct attr default_attr = { 0, 0, 0 };
+
+// DEC special graphics for 0x5f .. 0x7e (line drawing).
+static const uint16_t dec_graphics[32] = {
+    0x00a0, 0x25c6, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0,
+    0x00b1, 0x2424, 0x240b, 0x2518, 0x2510, 0x250c, 0x2514, 0x253c,
+    0x23ba, 0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c, 0x2524, 0x2534,
+    0x252c, 0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7
+};
+
+static bool
+attr_equal(const struct attr *a, const struct attr *b)
+{
+    return a->fg == b->fg && a->bg == b->bg && a->flags == b->flags;
+}
+
+/** Approximate display width: 0 for combining characters,
+ * 2 for East Asian wide and emoji, otherwise 1. */
+static int
+char_width(uint32_t c)
+{
+    if (c < 0x300)
+        return 1;
+    if ((c >= 0x300 && c <= 0x36f) || (c >= 0x1ab0 && c <= 0x1aff)
+        || (c >= 0x1dc0 && c <= 0x1dff) || (c >= 0x200b && c <= 0x200f)
+        || (c >= 0x20d0 && c <= 0x20ff) || (c >= 0xfe00 && c <= 0xfe0f)
+        || (c >= 0xfe20 && c <= 0xfe2f))
+        return 0;
+    if ((c >= 0x1100 && c <= 0x115f)
+        || (c >= 0x2e80 && c <= 0xa4cf && c != 0x303f)
+        || (c >= 0xac00 && c <= 0xd7a3) || (c >= 0xf900 && c <= 0xfaff)
+        || (c >= 0xfe30 && c <= 0xfe4f) || (c >= 0xff00 && c <= 0xff60)
+        || (c >= 0xffe0 && c <= 0xffe6) || (c >= 0x1f300 && c <= 0x1f64f)
+        || (c >= 0x1f900 && c <= 0x1f9ff) || (c >= 0x20000 && c <= 0x3fffd))
+        return 2;
+    return 1;
+}
+
+static void
+append_utf8(struct sbuf *out, uint32_t c)
+{
+    char buf[4];
+    int n;
+    if (c < 0x80) {
+        buf[0] = c;
+        n = 1;
+    } else if (c < 0x800) {
+        buf[0] = 0xc0 | (c >> 6);
+        buf[1] = 0x80 | (c & 0x3f);
+        n = 2;
+    } else if (c < 0x10000) {
+        buf[0] = 0xe0 | (c >> 12);
+        buf[1] = 0x80 | ((c >> 6) & 0x3f);
+        buf[2] = 0x80 | (c & 0x3f);
+        n = 3;
+    } else {
+        buf[0] = 0xf0 | (c >> 18);
+        buf[1] = 0x80 | ((c >> 12) & 0x3f);
+        buf[2] = 0x80 | ((c >> 6) & 0x3f);
+        buf[3] = 0x80 | (c & 0x3f);
+        n = 4;
+    }
+    sbuf_append(out, buf, n);
+}
+
+/* Lines */
+
+static struct line *
+lines_new(int rows)
+{
+    struct line *lines = xmalloc(rows * sizeof(struct line));
+    memset(lines, 0, rows * sizeof(struct line));
+    return lines;
+}
+
+static void
+lines_free(struct line *lines, int rows)
+{
+    for (int i = 0; i < rows; i++)
+        free(lines[i].cells);
+    free(lines);
+}
+
+/* Make sure cells [0, n) are in use, filling with default blanks. */
+static void
+line_extend(struct line *line, int n)
+{
+    if (n <= line->len)
+        return;
+    if (n > line->size) {
+        int size = 2 * line->size > n ? 2 * line->size : n;
+        line->cells = xrealloc(line->cells, size * sizeof(struct cell));
+        line->size = size;
+    }
+    for (int i = line->len; i < n; i++) {
+        line->cells[i].ch = ' ';
+        line->cells[i].attr = default_attr;
+    }
+    line->len = n;
+}
+
+/* Cells [from, to) are about to be overwritten: don't leave
+ * half of a double-width character on either side. */
+static void
+line_fix_wide(struct line *line, int from, int to)
+{
+    if (from > 0 && from < line->len && line->cells[from].ch == WIDE_CONT)
+        line->cells[from-1].ch = ' ';
+    if (to < line->len && line->cells[to].ch == WIDE_CONT)
+        line->cells[to].ch = ' ';
+}
+
+/* Erase cells [from, to), using the current background color. */
+static void
+erase_cells(struct screen *s, struct line *line, int from, int to)
+{
+    if (to > s->cols)
+        to = s->cols;
+    if (from >= to)
+        return;
+    line_fix_wide(line, from, to);
+    line->dirty = true;
+    if (s->attr.bg == 0 && to >= line->len) {
+        if (from < line->len)
+            line->len = from;
+        return;
+    }
+    line_extend(line, to);
+    for (int i = from; i < to; i++) {
+        line->cells[i].ch = ' ';
+        line->cells[i].attr = default_attr;
+        line->cells[i].attr.bg = s->attr.bg;
+    }
+}
+
+static void
+erase_line(struct screen *s, struct line *line)
+{
+    erase_cells(s, line, 0, s->cols);
+    line->wrapped = false;
+}
+
+static void
+insert_cells(struct screen *s, struct line *line, int x, int n)
+{
+    if (x >= line->len)
+        return;
+    line->dirty = true;
+    line_fix_wide(line, x, x);
+    int new_len = line->len + n;
+    if (new_len > s->cols)
+        new_len = s->cols;
+    line_extend(line, new_len);
+    int move = new_len - x - n;
+    if (move > 0)
+        memmove(&line->cells[x+n], &line->cells[x],
+                move * sizeof(struct cell));
+    int end = x + n < new_len ? x + n : new_len;
+    for (int i = x; i < end; i++) {
+        line->cells[i].ch = ' ';
+        line->cells[i].attr = default_attr;
+    }
+    if (line->len > 0 && line->len == s->cols
+        && char_width(line->cells[line->len-1].ch) == 2)
+        line->cells[line->len-1].ch = ' ';
+}
+
+static void
+delete_cells(struct screen *s, struct line *line, int x, int n)
+{
+    if (x >= line->len)
+        return;
+    line->dirty = true;
+    line_fix_wide(line, x, x + n);
+    if (x + n >= line->len) {
+        line->len = x;
+        return;
+    }
+    memmove(&line->cells[x], &line->cells[x+n],
+            (line->len - x - n) * sizeof(struct cell));
+    line->len -= n;
+}
+
+/* Scrolling */
+
+/** Move a line scrolled off the top into the history.
+ * Returns true if the history now owns the line's cells. */
+static bool
+history_push(struct screen *s, struct line *line)
+{
+    if (s->history_max <= 0)
+        return false;
+    int i;
+    if (s->history_count == s->history_max) {
+        i = s->history_start;
+        free(s->history[i].cells);
+        s->history_start = (i + 1) % s->history_max;
+    } else {
+        i = (s->history_start + s->history_count) % s->history_max;
+        s->history_count++;
+    }
+    struct line *h = &s->history[i];
+    *h = *line;
+    // Trim to the cells in use, to save memory.
+    if (h->len == 0) {
+        free(h->cells);
+        h->cells = NULL;
+    } else if (h->len < h->size)
+        h->cells = xrealloc(h->cells, h->len * sizeof(struct cell));
+    h->size = h->len;
+    return true;
+}
+
+static void
+history_clear(struct screen *s)
+{
+    for (int i = 0; i < s->history_count; i++)
+        free(s->history[(s->history_start + i) % s->history_max].cells);
+    s->history_start = 0;
+    s->history_count = 0;
+}
+
+/* Scroll lines [top, bottom) up by n, saving lines to history if save. */
+static void
+scroll_up(struct screen *s, int top, int bottom, int n, bool save)
+{
+    if (n > bottom - top)
+        n = bottom - top;
+    s->redraw = true;
+    for (; n > 0; n--) {
+        struct line first = s->lines[top];
+        if (save)
+            s->scrolled++;
+        if (save && history_push(s, &first)) {
+            first.cells = NULL;
+            first.size = 0;
+        }
+        first.len = 0;
+        first.wrapped = false;
+        memmove(&s->lines[top], &s->lines[top+1],
+                (bottom - top - 1) * sizeof(struct line));
+        s->lines[bottom-1] = first;
+        if (s->attr.bg != 0)
+            erase_line(s, &s->lines[bottom-1]);
+    }
+}
+
+static void
+scroll_down(struct screen *s, int top, int bottom, int n)
+{
+    if (n > bottom - top)
+        n = bottom - top;
+    s->redraw = true;
+    for (; n > 0; n--) {
+        struct line last = s->lines[bottom-1];
+        last.len = 0;
+        last.wrapped = false;
+        memmove(&s->lines[top+1], &s->lines[top],
+                (bottom - top - 1) * sizeof(struct line));
+        s->lines[top] = last;
+        if (s->attr.bg != 0)
+            erase_line(s, &s->lines[top]);
+    }
+}
+
+static void
+index_down(struct screen *s)
+{
+    if (s->y == s->m.bottom - 1)
+        scroll_up(s, s->m.top, s->m.bottom, 1, s->m.top == 0 && ! s->alternate);
+    else if (s->y < s->rows - 1)
+        s->y++;
+}
+
+static void
+reverse_index(struct screen *s)
+{
+    if (s->y == s->m.top)
+        scroll_down(s, s->m.top, s->m.bottom, 1);
+    else if (s->y > 0)
+        s->y--;
+}
+
+/* Cursor and modes */
+
+static void
+save_cursor(struct screen *s, struct cursor *c)
+{
+    c->x = s->x;
+    c->y = s->y;
+    c->attr = s->attr;
+    c->origin = s->m.origin;
+    c->charset = s->m.charset;
+}
+
+static void
+move_to(struct screen *s, int row, int col)
+{
+    int min_row = 0, max_row = s->rows - 1;
+    if (s->m.origin) {
+        row += s->m.top;
+        min_row = s->m.top;
+        max_row = s->m.bottom - 1;
+    }
+    s->y = row < min_row ? min_row : row > max_row ? max_row : row;
+    s->x = col < 0 ? 0 : col >= s->cols ? s->cols - 1 : col;
+    s->pending_wrap = false;
+}
+
+static void
+restore_cursor(struct screen *s, const struct cursor *c)
+{
+    s->attr = c->attr;
+    s->m.origin = c->origin;
+    s->m.charset = c->charset;
+    // Like xterm, clamp to the scroll region in origin mode.
+    move_to(s, c->origin ? c->y - s->m.top : c->y, c->x);
+}
+
+static void
+set_alternate(struct screen *s, bool alternate)
+{
+    if (alternate == s->alternate)
+        return;
+    if (alternate) {
+        save_cursor(s, &s->main_cursor);
+        s->main_lines = s->lines;
+        s->lines = lines_new(s->rows);
+    } else {
+        lines_free(s->lines, s->rows);
+        s->lines = s->main_lines;
+        s->main_lines = NULL;
+        s->alternate_left = true;
+    }
+    s->alternate = alternate;
+    s->redraw = true;
+}
+
+static void
+reset_modes(struct screen *s)
+{
+    s->attr = default_attr;
+    s->m.top = 0;
+    s->m.bottom = s->rows;
+    s->m.charset = 0;
+    s->m.autowrap = true;
+    s->m.origin = false;
+    s->m.insert = false;
+    s->m.cursor_visible = true;
+    s->m.app_cursor = false;
+    s->m.app_keypad = false;
+    s->m.bracketed_paste = false;
+    s->m.focus_events = false;
+    s->m.mouse_mode = 0;
+    s->m.mouse_encoding = 0;
+    save_cursor(s, &s->saved);
+}
+
+static void
+full_reset(struct screen *s)
+{
+    set_alternate(s, false);
+    for (int i = 0; i < s->rows; i++) {
+        s->lines[i].len = 0;
+        s->lines[i].wrapped = false;
+    }
+    s->x = 0;
+    s->y = 0;
+    s->pending_wrap = false;
+    s->redraw = true;
+    reset_modes(s);
+}
+
+/* Output */
+
+static void
+put_char(struct screen *s, uint32_t c)
+{
+    if (s->m.charset == 1 && c >= 0x5f && c <= 0x7e)
+        c = dec_graphics[c - 0x5f];
+    int w = char_width(c);
+    if (w == 0)
+        return; // combining characters are not modelled
+    if (s->pending_wrap
+        || (w == 2 && s->x == s->cols - 1 && s->m.autowrap)) {
+        s->lines[s->y].wrapped = true;
+        s->x = 0;
+        s->pending_wrap = false;
+        index_down(s);
+    }
+    if (w > s->cols - s->x)
+        return;
+    struct line *line = &s->lines[s->y];
+    if (s->m.insert)
+        insert_cells(s, line, s->x, w);
+    line_fix_wide(line, s->x, s->x + w);
+    line_extend(line, s->x + w);
+    line->dirty = true;
+    line->cells[s->x].ch = c;
+    line->cells[s->x].attr = s->attr;
+    if (w == 2) {
+        line->cells[s->x+1].ch = WIDE_CONT;
+        line->cells[s->x+1].attr = s->attr;
+    }
+    s->last_char = c;
+    s->x += w;
+    if (s->x >= s->cols) {
+        s->x = s->cols - 1;
+        s->pending_wrap = s->m.autowrap;
+    }
+}
+
+static void
+execute_control(struct screen *s, unsigned char c)
+{
+    switch (c) {
+    case '\b':
+        if (s->x > 0)
+            s->x--;
+        s->pending_wrap = false;
+        break;
+    case '\t':
+        s->x = (s->x / 8 + 1) * 8;
+        if (s->x >= s->cols)
+            s->x = s->cols - 1;
+        s->pending_wrap = false;
+        break;
+    case '\n': case '\v': case '\f':
+        s->pending_wrap = false;
+        index_down(s);
+        break;
+    case '\r':
+        s->x = 0;
+        s->pending_wrap = false;
+        break;
+    }
+}
+
+static int
+param(struct screen *s, int i, int default_value)
+{
+    return i < s->nparams && s->params[i] > 0 ? s->params[i] : default_value;
+}
+
+static uint32_t
+sgr_color(struct screen *s, int *i)
+{
+    int k = *i;
+    if (k + 2 < s->nparams && s->params[k+1] == 5) {
+        *i = k + 2;
+        return 1 + (s->params[k+2] & 0xff);
+    }
+    if (k + 4 < s->nparams && s->params[k+1] == 2) {
+        *i = k + 4;
+        return COLOR_RGB | ((s->params[k+2] & 0xff) << 16)
+            | ((s->params[k+3] & 0xff) << 8) | (s->params[k+4] & 0xff);
+    }
+    *i = s->nparams;
+    return 0;
+}
+
+static void
+set_sgr(struct screen *s)
+{
+    if (s->nparams == 0)
+        s->attr = default_attr;
+    for (int i = 0; i < s->nparams; i++) {
+        int p = s->params[i];
+        struct attr *a = &s->attr;
+        switch (p) {
+        case 0: *a = default_attr; break;
+        case 1: a->flags |= ATTR_BOLD; break;
+        case 2: a->flags |= ATTR_DIM; break;
+        case 3: a->flags |= ATTR_ITALIC; break;
+        case 4: a->flags |= ATTR_UNDERLINE; break;
+        case 5: case 6: a->flags |= ATTR_BLINK; break;
+        case 7: a->flags |= ATTR_INVERSE; break;
+        case 8: a->flags |= ATTR_INVISIBLE; break;
+        case 9: a->flags |= ATTR_STRIKE; break;
+        case 21: case 22: a->flags &= ~(ATTR_BOLD|ATTR_DIM); break;
+        case 23: a->flags &= ~ATTR_ITALIC; break;
+        case 24: a->flags &= ~ATTR_UNDERLINE; break;
+        case 25: a->flags &= ~ATTR_BLINK; break;
+        case 27: a->flags &= ~ATTR_INVERSE; break;
+        case 28: a->flags &= ~ATTR_INVISIBLE; break;
+        case 29: a->flags &= ~ATTR_STRIKE; break;
+        case 38: a->fg = sgr_color(s, &i); break;
+        case 39: a->fg = 0; break;
+        case 48: a->bg = sgr_color(s, &i); break;
+        case 49: a->bg = 0; break;
+        default:
+            if (p >= 30 && p <= 37)
+                a->fg = 1 + p - 30;
+            else if (p >= 40 && p <= 47)
+                a->bg = 1 + p - 40;
+            else if (p >= 90 && p <= 97)
+                a->fg = 1 + 8 + p - 90;
+            else if (p >= 100 && p <= 107)
+                a->bg = 1 + 8 + p - 100;
+        }
+    }
+}
+
+static void
+set_private_mode(struct screen *s, int mode, bool value)
+{
+    switch (mode) {
+    case 1: s->m.app_cursor = value; break;
+    case 6: s->m.origin = value; move_to(s, 0, 0); break;
+    case 7: s->m.autowrap = value; break;
+    case 25: s->m.cursor_visible = value; break;
+    case 47: case 1047:
+        set_alternate(s, value);
+        break;
+    case 1048:
+        if (value)
+            save_cursor(s, &s->saved);
+        else
+            restore_cursor(s, &s->saved);
+        break;
+    case 1049:
+        if (value) {
+            save_cursor(s, &s->saved);
+            set_alternate(s, true);
+        } else {
+            set_alternate(s, false);
+            restore_cursor(s, &s->saved);
+        }
+        break;
+    case 1000: case 1002: case 1003:
+        s->m.mouse_mode = value ? mode : 0;
+        break;
+    case 1004: s->m.focus_events = value; break;
+    case 1005: case 1006: case 1015:
+        s->m.mouse_encoding = value ? mode : 0;
+        break;
+    case 2004: s->m.bracketed_paste = value; break;
+    }
+}
+
+static void
+dispatch_csi(struct screen *s, unsigned char c)
+{
+    if (s->intermediate != 0)
+        return;
+    struct line *line = &s->lines[s->y];
+    int n = param(s, 0, 1);
+    if (s->private_marker == '?') {
+        if (c == 'h' || c == 'l') {
+            for (int i = 0; i < s->nparams; i++)
+                set_private_mode(s, s->params[i], c == 'h');
+        }
+        return;
+    }
+    if (s->private_marker != 0)
+        return;
+    switch (c) {
+    case '@':
+        insert_cells(s, line, s->x, n);
+        break;
+    case 'A': case 'F': {
+        // Stop at the top margin, unless already above it.
+        int min = s->y >= s->m.top ? s->m.top : 0;
+        s->y = s->y - n > min ? s->y - n : min;
+        if (c == 'F')
+            s->x = 0;
+        s->pending_wrap = false;
+        break;
+    }
+    case 'B': case 'e': case 'E': {
+        int max = s->y < s->m.bottom ? s->m.bottom - 1 : s->rows - 1;
+        s->y = s->y + n < max ? s->y + n : max;
+        if (c == 'E')
+            s->x = 0;
+        s->pending_wrap = false;
+        break;
+    }
+    case 'C': case 'a':
+        s->x = s->x + n < s->cols ? s->x + n : s->cols - 1;
+        s->pending_wrap = false;
+        break;
+    case 'D':
+        s->x = s->x > n ? s->x - n : 0;
+        s->pending_wrap = false;
+        break;
+    case 'G': case '`':
+        s->x = n - 1 < s->cols ? n - 1 : s->cols - 1;
+        s->pending_wrap = false;
+        break;
+    case 'H': case 'f':
+        move_to(s, param(s, 0, 1) - 1, param(s, 1, 1) - 1);
+        break;
+    case 'I':
+        for (; n > 0; n--)
+            execute_control(s, '\t');
+        break;
+    case 'J': {
+        int mode = param(s, 0, 0);
+        if (mode == 3) {
+            history_clear(s);
+            break;
+        }
+        int from = mode == 0 ? s->y + 1 : 0;
+        int to = mode == 1 ? s->y : s->rows;
+        if (mode == 0)
+            erase_cells(s, line, s->x, s->cols);
+        else if (mode == 1)
+            erase_cells(s, line, 0, s->x + 1);
+        for (int i = from; i < to; i++)
+            if (mode == 2 || i != s->y)
+                erase_line(s, &s->lines[i]);
+        break;
+    }
+    case 'K': {
+        int mode = param(s, 0, 0);
+        if (mode == 0)
+            erase_cells(s, line, s->x, s->cols);
+        else if (mode == 1)
+            erase_cells(s, line, 0, s->x + 1);
+        else
+            erase_line(s, line);
+        break;
+    }
+    case 'L':
+        if (s->y >= s->m.top && s->y < s->m.bottom) {
+            scroll_down(s, s->y, s->m.bottom, n);
+            s->x = 0;
+            s->pending_wrap = false;
+        }
+        break;
+    case 'M':
+        if (s->y >= s->m.top && s->y < s->m.bottom) {
+            scroll_up(s, s->y, s->m.bottom, n, false);
+            s->x = 0;
+            s->pending_wrap = false;
+        }
+        break;
+    case 'P':
+        delete_cells(s, line, s->x, n);
+        break;
+    case 'S':
+        scroll_up(s, s->m.top, s->m.bottom, n, s->m.top == 0 && ! s->alternate);
+        break;
+    case 'T':
+        if (s->nparams <= 1)
+            scroll_down(s, s->m.top, s->m.bottom, n);
+        break;
+    case 'X':
+        erase_cells(s, line, s->x, s->x + n);
+        break;
+    case 'Z':
+        for (; n > 0 && s->x > 0; n--)
+            s->x = (s->x - 1) / 8 * 8;
+        s->pending_wrap = false;
+        break;
+    case 'b':
+        if (s->last_char != 0) {
+            if (n > 65535)
+                n = 65535;
+            for (; n > 0; n--)
+                put_char(s, s->last_char);
+        }
+        break;
+    case 'd':
+        move_to(s, param(s, 0, 1) - 1, s->x);
+        break;
+    case 'h': case 'l':
+        for (int i = 0; i < s->nparams; i++)
+            if (s->params[i] == 4)
+                s->m.insert = c == 'h';
+        break;
+    case 'm':
+        set_sgr(s);
+        break;
+    case 'r': {
+        int top = param(s, 0, 1) - 1;
+        int bottom = param(s, 1, s->rows);
+        if (bottom > s->rows)
+            bottom = s->rows;
+        if (top < bottom - 1) {
+            s->m.top = top;
+            s->m.bottom = bottom;
+            move_to(s, 0, 0);
+        }
+        break;
+    }
+    case 's':
+        if (s->nparams == 0)
+            save_cursor(s, &s->saved);
+        break;
+    case 'u':
+        // With parameters, this is a DomTerm-specific sequence.
+        if (s->nparams == 0)
+            restore_cursor(s, &s->saved);
+        break;
+    }
+}
+
+static void
+dispatch_esc(struct screen *s, unsigned char c)
+{
+    s->state = S_GROUND;
+    switch (c) {
+    case '[':
+        s->state = S_CSI;
+        s->nparams = 0;
+        s->private_marker = 0;
+        s->intermediate = 0;
+        break;
+    case ']':
+        s->state = S_OSC;
+        s->osc.len = 0;
+        break;
+    case 'P': case 'X': case '^': case '_':
+        s->state = S_STRING;
+        break;
+    case '(':
+        s->state = S_ESC_CHARSET;
+        break;
+    case ')': case '*': case '+': case '-': case '.': case '/':
+    case '#': case '%': case ' ':
+        s->state = S_ESC_SKIP;
+        break;
+    case '7':
+        save_cursor(s, &s->saved);
+        break;
+    case '8':
+        restore_cursor(s, &s->saved);
+        break;
+    case 'D':
+        s->pending_wrap = false;
+        index_down(s);
+        break;
+    case 'E':
+        s->x = 0;
+        s->pending_wrap = false;
+        index_down(s);
+        break;
+    case 'M':
+        s->pending_wrap = false;
+        reverse_index(s);
+        break;
+    case 'c':
+        full_reset(s);
+        break;
+    case '=':
+        s->m.app_keypad = true;
+        break;
+    case '>':
+        s->m.app_keypad = false;
+        break;
+    }
+}
+
+static void
+end_osc(struct screen *s)
+{
+    char *str = s->osc.buffer;
+    size_t len = s->osc.len;
+    if (len >= 2 && (str[0] == '0' || str[0] == '2') && str[1] == ';') {
+        free(s->title);
+        s->title = xmalloc(len - 1);
+        memcpy(s->title, str + 2, len - 2);
+        s->title[len - 2] = '\0';
+        s->title_changed = true;
+    }
+    s->osc.len = 0;
+}
+
+static void
+feed_byte(struct screen *s, unsigned char c)
+{
+    if (c == 0x18 || c == 0x1a) { // CAN, SUB
+        s->state = S_GROUND;
+        return;
+    }
+    if (c == 0x1b && s->state != S_STRING && s->state != S_OSC) {
+        s->state = S_ESC;
+        return;
+    }
+    switch (s->state) {
+    case S_GROUND:
+        if (c < 0x20)
+            execute_control(s, c);
+        else if (c < 0x7f)
+            put_char(s, c);
+        break;
+    case S_ESC:
+        if (c < 0x20)
+            execute_control(s, c);
+        else
+            dispatch_esc(s, c);
+        break;
+    case S_ESC_CHARSET:
+        s->m.charset = c == '0';
+        s->state = S_GROUND;
+        break;
+    case S_ESC_SKIP:
+        s->state = S_GROUND;
+        break;
+    case S_CSI:
+        if (c >= '0' && c <= '9') {
+            if (s->nparams == 0) {
+                s->nparams = 1;
+                s->params[0] = 0;
+            }
+            int *p = &s->params[s->nparams-1];
+            if (*p < 100000)
+                *p = 10 * *p + (c - '0');
+        } else if (c == ';' || c == ':') {
+            if (s->nparams == 0) {
+                s->nparams = 1;
+                s->params[0] = 0;
+            }
+            if (s->nparams < SCREEN_MAX_PARAMS)
+                s->params[s->nparams++] = 0;
+        } else if (c >= '<' && c <= '?') {
+            s->private_marker = c;
+        } else if (c >= 0x20 && c <= 0x2f) {
+            s->intermediate = c;
+        } else if (c >= 0x40 && c <= 0x7e) {
+            s->state = S_GROUND;
+            dispatch_csi(s, c);
+        } else if (c < 0x20) {
+            execute_control(s, c);
+        }
+        break;
+    case S_OSC:
+        if (c == 0x07) {
+            end_osc(s);
+            s->state = S_GROUND;
+        } else if (c == 0x1b) {
+            s->state = S_STRING_ESC;
+        } else if (s->osc.len < SCREEN_MAX_OSC) {
+            sbuf_append(&s->osc, (char *) &c, 1);
+        }
+        break;
+    case S_STRING:
+        if (c == 0x1b)
+            s->state = S_STRING_ESC;
+        break;
+    case S_STRING_ESC:
+        // ESC \ (or any other character) ends the string.
+        end_osc(s);
+        s->state = S_GROUND;
+        if (c != '\\')
+            feed_byte(s, c);
+        break;
+    }
+}
+
+void
+screen_feed(struct screen *s, const char *data, size_t length)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    const unsigned char *end = p + length;
+    while (p < end) {
+        unsigned char c = *p++;
+        if (s->utf8_pending > 0) {
+            if ((c & 0xc0) == 0x80) {
+                s->utf8_char = (s->utf8_char << 6) | (c & 0x3f);
+                if (--s->utf8_pending == 0)
+                    put_char(s, s->utf8_char);
+                continue;
+            }
+            s->utf8_pending = 0;
+            put_char(s, 0xfffd);
+        }
+        if (c < 0x80 || s->state != S_GROUND) {
+            feed_byte(s, c);
+        } else if (c >= 0xc2 && c <= 0xdf) {
+            s->utf8_char = c & 0x1f;
+            s->utf8_pending = 1;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            s->utf8_char = c & 0x0f;
+            s->utf8_pending = 2;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            s->utf8_char = c & 0x07;
+            s->utf8_pending = 3;
+        } else
+            put_char(s, 0xfffd);
+    }
+}
+
+/** True if not in the middle of an escape sequence or character,
+ * so the following output can be interpreted on its own. */
+bool
+screen_idle(struct screen *s)
+{
+    return s->state == S_GROUND && s->utf8_pending == 0;
+}
+
+/* Snapshot */
+
+static void
+append_color(struct sbuf *out, uint32_t color, int base)
+{
+    if (color == 0)
+        return;
+    if (color & COLOR_RGB)
+        sbuf_printf(out, ";%d;2;%d;%d;%d", base + 8, (color >> 16) & 0xff,
+                    (color >> 8) & 0xff, color & 0xff);
+    else if (color <= 8)
+        sbuf_printf(out, ";%d", base + color - 1);
+    else if (color <= 16)
+        sbuf_printf(out, ";%d", base + 60 + color - 9);
+    else
+        sbuf_printf(out, ";%d;5;%d", base + 8, color - 1);
+}
+
+static void
+append_sgr(struct sbuf *out, const struct attr *a)
+{
+    static const char codes[] = { 1, 2, 3, 4, 5, 7, 8, 9 };
+    sbuf_printf(out, "\033[0");
+    for (int i = 0; i < 8; i++)
+        if (a->flags & (1 << i))
+            sbuf_printf(out, ";%d", codes[i]);
+    append_color(out, a->fg, 30);
+    append_color(out, a->bg, 40);
+    sbuf_printf(out, "m");
+}
+
+static bool
+is_default_blank(const struct cell *c)
+{
+    return c->ch == ' ' && attr_equal(&c->attr, &default_attr);
+}
+
+/* Append the cells of a line.  A wrapped line is padded to the full
+ * width, so the next character wraps in the same place.
+ * Returns the number of columns written. */
+static int
+snapshot_line(struct screen *s, struct sbuf *out, struct line *line,
+              struct attr *cur, bool pad)
+{
+    int len = line->len;
+    while (len > 0 && is_default_blank(&line->cells[len-1]))
+        len--;
+    for (int i = 0; i < len; i++) {
+        struct cell *c = &line->cells[i];
+        if (c->ch == WIDE_CONT)
+            continue;
+        if (! attr_equal(&c->attr, cur)) {
+            append_sgr(out, &c->attr);
+            *cur = c->attr;
+        }
+        append_utf8(out, c->ch);
+    }
+    // Reset attributes at end of line, so a following newline
+    // doesn't fill with the background color.
+    if (! attr_equal(cur, &default_attr)) {
+        sbuf_printf(out, "\033[m");
+        *cur = default_attr;
+    }
+    if (pad && len < s->cols) {
+        int n = s->cols - len;
+        memset(sbuf_blank(out, n), ' ', n);
+        len = s->cols;
+    }
+    return len;
+}
+
+static void
+default_modes(struct screen *s, struct modes *m)
+{
+    memset(m, 0, sizeof(struct modes));
+    m->bottom = s->rows;
+    m->autowrap = true;
+    m->cursor_visible = true;
+}
+
+static void
+append_private_mode(struct sbuf *out, int mode, bool value)
+{
+    sbuf_printf(out, "\033[?%d%c", mode, value ? 'h' : 'l');
+}
+
+/* Append escape sequences to change modes from 'from' to the current ones. */
+static void
+append_modes(struct screen *s, struct sbuf *out, const struct modes *from)
+{
+    const struct modes *m = &s->m;
+    if (m->top != from->top || m->bottom != from->bottom)
+        sbuf_printf(out, "\033[%d;%dr", m->top + 1, m->bottom);
+    if (m->autowrap != from->autowrap)
+        append_private_mode(out, 7, m->autowrap);
+    if (m->origin != from->origin)
+        append_private_mode(out, 6, m->origin);
+    if (m->app_cursor != from->app_cursor)
+        append_private_mode(out, 1, m->app_cursor);
+    if (m->app_keypad != from->app_keypad)
+        sbuf_printf(out, m->app_keypad ? "\033=" : "\033>");
+    if (m->mouse_mode != from->mouse_mode)
+        append_private_mode(out, m->mouse_mode ? m->mouse_mode
+                            : from->mouse_mode, m->mouse_mode != 0);
+    if (m->mouse_encoding != from->mouse_encoding)
+        append_private_mode(out, m->mouse_encoding ? m->mouse_encoding
+                            : from->mouse_encoding, m->mouse_encoding != 0);
+    if (m->focus_events != from->focus_events)
+        append_private_mode(out, 1004, m->focus_events);
+    if (m->bracketed_paste != from->bracketed_paste)
+        append_private_mode(out, 2004, m->bracketed_paste);
+    if (m->insert != from->insert)
+        sbuf_printf(out, m->insert ? "\033[4h" : "\033[4l");
+    if (m->cursor_visible != from->cursor_visible)
+        append_private_mode(out, 25, m->cursor_visible);
+    if (m->charset != from->charset)
+        sbuf_printf(out, m->charset ? "\033(0" : "\033(B");
+}
+
+/* Append cursor position (if needed) and current attributes,
+ * where cur is the receiver's current attributes. */
+static void
+append_cursor(struct screen *s, struct sbuf *out, bool move,
+              struct attr *cur)
+{
+    int row = s->y + 1 - (s->m.origin ? s->m.top : 0);
+    struct line *line = &s->lines[s->y];
+    if (s->pending_wrap && line->len == s->cols) {
+        // Re-write the last character, to get the same pending wrap.
+        int x = s->cols - 1;
+        if (x > 0 && line->cells[x].ch == WIDE_CONT)
+            x--;
+        sbuf_printf(out, "\033[%d;%dH", row, x + 1);
+        if (s->m.charset)
+            sbuf_printf(out, "\033(B");
+        append_sgr(out, &line->cells[x].attr);
+        append_utf8(out, line->cells[x].ch);
+        *cur = line->cells[x].attr;
+        if (s->m.charset)
+            sbuf_printf(out, "\033(0");
+    } else if (move)
+        sbuf_printf(out, "\033[%d;%dH", row, s->x + 1);
+    if (! attr_equal(&s->attr, cur)) {
+        append_sgr(out, &s->attr);
+        *cur = s->attr;
+    }
+}
+
+static bool
+line_is_blank(struct line *line)
+{
+    for (int i = 0; i < line->len; i++)
+        if (! is_default_blank(&line->cells[i]))
+            return false;
+    return true;
+}
+
+void
+screen_snapshot(struct screen *s, struct sbuf *out)
+{
+    size_t start = out->len;
+    struct attr cur = default_attr;
+    for (int i = 0; i < s->history_count; i++) {
+        struct line *line =
+            &s->history[(s->history_start + i) % s->history_max];
+        snapshot_line(s, out, line, &cur, line->wrapped);
+        if (! line->wrapped)
+            sbuf_printf(out, "\r\n");
+    }
+
+    // Main buffer.  Without history we can stop at the last non-blank
+    // line (or the cursor); otherwise all the rows are needed so the
+    // first row ends up at the top of the receiving screen.
+    struct line *lines = s->alternate ? s->main_lines : s->lines;
+    int cursor_y = s->alternate ? s->main_cursor.y : s->y;
+    int nlines = s->rows;
+    if (s->history_count == 0) {
+        while (nlines > cursor_y + 1 && line_is_blank(&lines[nlines-1]))
+            nlines--;
+    }
+    for (int i = 0; i < nlines; i++) {
+        bool wrapped = lines[i].wrapped && i + 1 < nlines;
+        snapshot_line(s, out, &lines[i], &cur, wrapped);
+        if (! wrapped && i + 1 < nlines)
+            sbuf_printf(out, "\r\n");
+    }
+
+    if (s->alternate) {
+        sbuf_printf(out, "\033[%d;%dH\033[?1049h",
+                    s->main_cursor.y + 1, s->main_cursor.x + 1);
+        for (int i = 0; i < s->rows; i++) {
+            if (line_is_blank(&s->lines[i]))
+                continue;
+            sbuf_printf(out, "\033[%dH", i + 1);
+            snapshot_line(s, out, &s->lines[i], &cur, false);
+        }
+    }
+
+    if (s->title != NULL)
+        sbuf_printf(out, "\033]2;%s\007", s->title);
+    struct modes modes;
+    default_modes(s, &modes);
+    append_modes(s, out, &modes);
+    append_cursor(s, out, s->x != 0 || s->y != 0 || out->len > start, &cur);
+}
+
+/* Redraw changed lines (or all lines, if redraw). */
+static void
+delta_lines(struct screen *s, struct sbuf *out, struct line *lines,
+            bool redraw, struct attr *cur)
+{
+    bool continued = false; // previous line will wrap into this one
+    for (int i = 0; i < s->rows; i++) {
+        struct line *line = &lines[i];
+        if (redraw || line->dirty) {
+            if (! continued || line_is_blank(line))
+                sbuf_printf(out, "\033[%dH", i + 1);
+            int width = snapshot_line(s, out, line, cur, false);
+            if (width < s->cols)
+                sbuf_printf(out, "\033[K");
+            // Let a full wrapped line wrap in the receiver too,
+            // unless that would scroll.
+            continued = line->wrapped && width == s->cols
+                && s->sent_modes.autowrap && i + 1 < s->sent_modes.bottom
+                && i + 1 < s->rows
+                && (redraw || lines[i+1].dirty);
+        } else
+            continued = false;
+    }
+}
+
+/** Append what changed since the last delta (or screen_delta_reset).
+ * Lines added to the history are approximated by scrolling up the
+ * previous screen contents; then changed lines are redrawn.
+ * Intermediate output is skipped - that is the point.
+ */
+void
+screen_delta(struct screen *s, struct sbuf *out)
+{
+    size_t start = out->len;
+    struct attr cur = s->sent_attr;
+    bool redraw = s->redraw;
+    // Row numbers below are absolute.
+    if (s->sent_modes.origin) {
+        sbuf_printf(out, "\033[?6l");
+        s->sent_modes.origin = false;
+    }
+    if (s->sent_alternate && (s->alternate_left || ! s->alternate)) {
+        // The main buffer was shown since; the receiver must catch up.
+        // This restores the receiver's saved cursor; reset what it affects.
+        sbuf_printf(out, "\033[?1049l\033[m\033(B\033[?6l");
+        cur = default_attr;
+        s->sent_modes.charset = 0;
+        s->sent_modes.origin = false;
+        redraw = true;
+    }
+    if (! s->sent_alternate || s->alternate_left || ! s->alternate) {
+        // The receiver shows the main buffer: bring it up to date first.
+        if (s->scrolled > 0) {
+            int n = s->scrolled < s->rows ? s->scrolled : s->rows;
+            sbuf_printf(out, "\033[r\033[%dH", s->rows);
+            memset(sbuf_blank(out, n), '\n', n);
+            s->sent_modes.top = 0;
+            s->sent_modes.bottom = s->rows;
+            redraw = true;
+        }
+        delta_lines(s, out, s->alternate ? s->main_lines : s->lines,
+                    redraw, &cur);
+        if (s->alternate) {
+            sbuf_printf(out, "\033[%d;%dH\033[?1049h",
+                        s->main_cursor.y + 1, s->main_cursor.x + 1);
+            delta_lines(s, out, s->lines, true, &cur);
+        }
+    } else
+        delta_lines(s, out, s->lines, redraw, &cur);
+    if (s->title_changed && s->title != NULL)
+        sbuf_printf(out, "\033]2;%s\007", s->title);
+    append_modes(s, out, &s->sent_modes);
+    append_cursor(s, out, out->len > start || s->x != s->sent_x
+                  || s->y != s->sent_y, &cur);
+    screen_delta_reset(s);
+}
+
+/** Forget about changes so far - clients are up to date. */
+void
+screen_delta_reset(struct screen *s)
+{
+    for (int i = 0; i < s->rows; i++) {
+        s->lines[i].dirty = false;
+        if (s->main_lines != NULL)
+            s->main_lines[i].dirty = false;
+    }
+    s->scrolled = 0;
+    s->redraw = false;
+    s->title_changed = false;
+    s->sent_alternate = s->alternate;
+    s->alternate_left = false;
+    s->sent_modes = s->m;
+    s->sent_x = s->x;
+    s->sent_y = s->y;
+    s->sent_attr = s->attr;
+}
+
+/* Creation and resizing */
+
+struct screen *
+screen_new(int rows, int cols, int scrollback_lines)
+{
+    struct screen *s = xmalloc(sizeof(struct screen));
+    memset(s, 0, sizeof(struct screen));
+    s->rows = rows;
+    s->cols = cols;
+    s->lines = lines_new(rows);
+    s->history_max = scrollback_lines > 0 ? scrollback_lines : 0;
+    if (s->history_max > 0)
+        s->history = xmalloc(s->history_max * sizeof(struct line));
+    s->state = S_GROUND;
+    sbuf_init(&s->osc);
+    reset_modes(s);
+    screen_delta_reset(s);
+    return s;
+}
+
+void
+screen_free(struct screen *s)
+{
+    if (s->main_lines != NULL)
+        lines_free(s->main_lines, s->rows);
+    lines_free(s->lines, s->rows);
+    history_clear(s);
+    free(s->history);
+    sbuf_free(&s->osc);
+    free(s->title);
+    free(s);
+}
+
+static struct line *
+resize_lines(struct screen *s, struct line *lines, int rows, int cols,
+             int shift, bool save)
+{
+    // Drop (or save to history) the top 'shift' lines, so the cursor
+    // stays on the screen; then drop or add lines at the bottom.
+    for (int i = 0; i < shift; i++) {
+        if (! (save && history_push(s, &lines[i])))
+            free(lines[i].cells);
+    }
+    struct line *result = lines_new(rows);
+    int keep = s->rows - shift < rows ? s->rows - shift : rows;
+    memcpy(result, lines + shift, keep * sizeof(struct line));
+    for (int i = shift + keep; i < s->rows; i++)
+        free(lines[i].cells);
+    free(lines);
+    for (int i = 0; i < keep; i++) {
+        struct line *line = &result[i];
+        if (line->len > cols) {
+            line_fix_wide(line, cols, cols);
+            line->len = cols;
+        }
+    }
+    return result;
+}
+
+void
+screen_resize(struct screen *s, int rows, int cols)
+{
+    if (rows <= 0 || cols <= 0 || (rows == s->rows && cols == s->cols))
+        return;
+    int shift = s->y >= rows ? s->y - rows + 1 : 0;
+    s->lines = resize_lines(s, s->lines, rows, cols, shift, ! s->alternate);
+    s->y -= shift;
+    if (s->main_lines != NULL) {
+        int mshift = s->main_cursor.y >= rows
+            ? s->main_cursor.y - rows + 1 : 0;
+        s->main_lines = resize_lines(s, s->main_lines, rows, cols,
+                                     mshift, true);
+        s->main_cursor.y -= mshift;
+    }
+    s->rows = rows;
+    s->cols = cols;
+    if (s->x >= cols)
+        s->x = cols - 1;
+    s->pending_wrap = false;
+    s->m.top = 0;
+    s->m.bottom = rows;
+    s->redraw = true;
+    if (s->saved.y >= rows)
+        s->saved.y = rows - 1;
+    if (s->main_cursor.x >= cols)
+        s->main_cursor.x = cols - 1;
+}
@@ -0,0 +1,23 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+
+/** A headless model of a terminal's screen and scrollback.
+ * It is fed the same pty output that is sent to the browser,
+ * and can produce a snapshot: characters and escape sequences that
+ * re-create the current state in an empty terminal.
+ * Only the common VT100/xterm subset is modelled; DomTerm-specific
+ * sequences (for example inserted HTML) are ignored.
+ */
+struct screen;
+struct sbuf;
+
+extern struct screen *screen_new(int rows, int cols, int scrollback_lines);
+extern void screen_free(struct screen *screen);
+extern void screen_resize(struct screen *screen, int rows, int cols);
+extern void screen_feed(struct screen *screen, const char *data, size_t length);
+extern bool screen_idle(struct screen *screen);
+extern void screen_snapshot(struct screen *screen, struct sbuf *out);
+extern void screen_delta(struct screen *screen, struct sbuf *out);
+extern void screen_delta_reset(struct screen *screen);
+
+#endif
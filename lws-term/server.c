@@ -166,22 +166,93 @@ struct lws_context_creation_info info;
 struct cmd_client *cclient;
 int last_session_number = 0;
 
+int service_threads = 1;
+__thread int service_tsi = 0;
+
+/* With several service threads, our callbacks (and so all the session,
+ * window and server state) are serialized by service_lock, while lws
+ * itself (accepting connections, parsing and framing websocket messages,
+ * TLS) runs concurrently.  A wsi may only be changed by its own service
+ * thread; requests for other threads go through run_thread_requests.
+ */
+static pthread_mutex_t service_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int service_lock_depth = 0; // callbacks can nest
+
+static void
+lock_service(void)
+{
+    if (service_lock_depth++ == 0 && service_threads > 1)
+        pthread_mutex_lock(&service_lock);
+}
+
+static void
+unlock_service(void)
+{
+    if (--service_lock_depth == 0 && service_threads > 1)
+        pthread_mutex_unlock(&service_lock);
+}
+
+/** Let other threads run (for example while writing a frame).
+ * Returns the depth to pass to service_relock.
+ */
+int
+service_unlock_all(void)
+{
+    int depth = service_lock_depth;
+    if (depth > 0) {
+        service_lock_depth = 1;
+        unlock_service();
+    }
+    return depth;
+}
+
+void
+service_relock(int depth)
+{
+    if (depth > 0) {
+        lock_service();
+        service_lock_depth = depth;
+    }
+}
+
+#define LOCKED_CALLBACK(NAME)                                           \
+static int                                                              \
+locked_##NAME(struct lws *wsi, enum lws_callback_reasons reason,        \
+              void *user, void *in, size_t len)                         \
+{                                                                       \
+    lock_service();                                                     \
+    int r = NAME(wsi, reason, user, in, len);                           \
+    unlock_service();                                                   \
+    return r;                                                           \
+}
+LOCKED_CALLBACK(callback_http)
+LOCKED_CALLBACK(callback_tty)
+LOCKED_CALLBACK(callback_pty)
+LOCKED_CALLBACK(callback_cmd)
+LOCKED_CALLBACK(callback_reaper)
+#if HAVE_INOTIFY
+LOCKED_CALLBACK(callback_inotify)
+#endif
+
 static const struct lws_protocols protocols[] = {
         /* http server for (mostly) static data */
-        {"http-only", callback_http, sizeof(struct http_client),  0},
+        {"http-only", locked_callback_http, sizeof(struct http_client),  0},
 
         /* websockets server for communicating with browser */
-        {"domterm",   callback_tty,  sizeof(struct tty_client),  0},
+        {"domterm",   locked_callback_tty,  sizeof(struct tty_client),  0},
 
         /* callbacks for pty I/O, one pty for each session (process) */
-        {"pty",       callback_pty,  sizeof(struct pty_client),  0},
+        {"pty",       locked_callback_pty,  sizeof(struct pty_client),  0},
 
         /* Unix domain socket for client to send to commands to server */
-        {"cmd",       callback_cmd,  sizeof(struct cmd_client),  0},
+        {"cmd",       locked_callback_cmd,  sizeof(struct cmd_client),  0},
+
+        /* pipe written on SIGCHLD, to reap exited processes */
+        {"reaper",    locked_callback_reaper, 0,  0},
 
 #if HAVE_INOTIFY
         /* calling back for "inotify" to watch settings.ini */
-        {"inotify",    callback_inotify,  0,  0},
+        {"inotify",    locked_callback_inotify,  0,  0},
 #endif
 
         {NULL,        NULL,          0,                          0}
@@ -760,28 +831,283 @@ get_domterm_jar_path()
     return get_bin_relative_path(DOMTERM_DIR_RELATIVE "/domterm.jar");
 }
 
-static struct json_object *
-state_to_json(int argc, char *const*argv, char *const *env)
+static void
+put_be(struct sbuf *buf, uint64_t value, int n)
 {
-    struct json_object *jobj = json_object_new_object();
-    struct json_object *jargv = json_object_new_array();
-    struct json_object *jenv = json_object_new_array();
-    const char *result;
-    char *cwd = getcwd(NULL, 0); /* FIXME used GNU extension */
-    int i;
-    for (i = 0; i < argc; i++)
-        json_object_array_add(jargv, json_object_new_string(argv[i]));
-    for (i = 0; ; i++) {
-        const char *e = env[i];
-        if (e == NULL)
+    char *p = sbuf_blank(buf, n);
+    while (--n >= 0) {
+        p[n] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+/* Build a command message (see CMD_PROTOCOL_VERSION). */
+static void
+command_message(struct sbuf *buf, const char *cwd, int argc,
+                char *const*argv, char *const*env, bool full_env)
+{
+    struct sbuf body;
+    sbuf_init(&body);
+    char *header = sbuf_blank(&body, 2);
+    header[0] = CMD_PROTOCOL_VERSION;
+    header[1] = full_env ? CMD_ENV_FULL : CMD_ENV_DIGEST;
+    put_be(&body, string_array_digest(env), 8);
+    int envc = 0;
+    size_t env_length = 0;
+    for (; env[envc] != NULL; envc++)
+        env_length += strlen(env[envc]) + 1;
+    put_be(&body, argc, 4);
+    put_be(&body, envc, 4);
+    put_be(&body, env_length, 4);
+    sbuf_append(&body, cwd == NULL ? "" : cwd,
+                cwd == NULL ? 1 : strlen(cwd) + 1);
+    for (int i = 0; i < argc; i++)
+        sbuf_append(&body, argv[i], strlen(argv[i]) + 1);
+    for (int i = 0; full_env && i < envc; i++)
+        sbuf_append(&body, env[i], strlen(env[i]) + 1);
+    buf->len = 0;
+    // The message is its length (and a newline), then the body.
+    sbuf_printf(buf, "%zu\n", body.len);
+    sbuf_append(buf, body.buffer, body.len);
+    sbuf_free(&body);
+}
+
+static bool
+send_all(int socket, const char *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t n = write(socket, data, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool
+read_reply(int socket, char reply[2])
+{
+    size_t got = 0;
+    while (got < 2) {
+        ssize_t n = read(socket, reply + got, 2 - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        got += n;
+    }
+    return true;
+}
+
+/* Send a message, passing our standard output and error with it. */
+static bool
+send_with_fds(int socket, struct sbuf *buf)
+{
+    struct msghdr msg;
+    int myfds[2];
+    myfds[0] = STDOUT_FILENO;
+    myfds[1] = STDERR_FILENO;
+    union u { // for alignment
+      char buf[CMSG_SPACE(sizeof myfds)];
+      struct cmsghdr align;
+    } u;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof u.buf;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+    memcpy(CMSG_DATA(cmsg), myfds, sizeof(int) * 2);
+    msg.msg_controllen = cmsg->cmsg_len;
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    struct iovec iov;
+    iov.iov_base = buf->buffer;
+    iov.iov_len = buf->len;
+    msg.msg_name = NULL;
+    msg.msg_namelen = 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_flags = 0;
+    errno = 0;
+    ssize_t n1 = sendmsg(socket, &msg, 0);
+    return n1 > 0 && send_all(socket, buf->buffer + n1, buf->len - n1);
+}
+
+/* Ask the server to run a command.  The environment is only sent if
+ * the server doesn't already have it.  Returns the exit code.
+ */
+static int
+send_command(int socket, const char *cwd, int argc, char *const*argv,
+             char *const*env)
+{
+    struct sbuf buf;
+    sbuf_init(&buf);
+    command_message(&buf, cwd, argc, argv, env, false);
+    bool ok = send_with_fds(socket, &buf);
+    close(STDOUT_FILENO);
+    close(STDERR_FILENO);
+    char reply[2];
+    ok = ok && read_reply(socket, reply);
+    if (ok && reply[0] == CMD_REPLY_NEED_ENV) {
+        command_message(&buf, cwd, argc, argv, env, true);
+        ok = send_all(socket, buf.buffer, buf.len)
+            && read_reply(socket, reply);
+    }
+    sbuf_free(&buf);
+    return ok && reply[0] == CMD_REPLY_RESULT ? reply[1] : -1;
+}
+
+// Commands sent by "domterm batch" before waiting for their replies.
+#define BATCH_MAX_PENDING 32
+
+struct batch_command {
+    int line; // line number in the input
+    int argc;
+    char **argv; // the options of "domterm batch", then the command
+    char **words; // from parse_args (argv points into this)
+};
+
+struct batch_state {
+    int socket;
+    const char *cwd;
+    struct batch_command pending[BATCH_MAX_PENDING]; // a ring buffer
+    int first, npending;
+    struct sbuf buf;
+    int failures;
+};
+
+static void
+batch_status(struct batch_state *state, int line, int status)
+{
+    if (status != 0) {
+        fprintf(stderr, "domterm batch: line %d: exit status %d\n",
+                line, status);
+        state->failures++;
+    }
+}
+
+/* Wait for the reply to the oldest pending command.
+ * Returns false if the connection failed.
+ * The first command sent the environment in full, and the server
+ * keeps it for the connection, so CMD_REPLY_NEED_ENV is not expected:
+ * with up to BATCH_MAX_PENDING later commands already sent, the
+ * command could not be re-sent in order anyway.
+ */
+static bool
+batch_reply(struct batch_state *state)
+{
+    struct batch_command *bc = &state->pending[state->first];
+    state->first = (state->first + 1) % BATCH_MAX_PENDING;
+    state->npending--;
+    char reply[2];
+    bool ok = read_reply(state->socket, reply);
+    if (ok)
+        batch_status(state, bc->line,
+                     reply[0] == CMD_REPLY_RESULT ? reply[1] : -1);
+    free(bc->argv);
+    free(bc->words);
+    return ok;
+}
+
+/* Run the commands read from standard input, one per line, over a
+ * single connection to the server.  Commands for the server are sent
+ * without waiting for earlier ones to finish (they are still run in
+ * order); commands that run in the client first wait for those.
+ * prefix is argv up to "batch": the program name and options.
+ */
+static int
+run_batch(int socket, int nprefix, char **prefix, struct options *opts)
+{
+    struct batch_state state;
+    state.socket = socket;
+    state.cwd = getcwd(NULL, 0);
+    state.first = 0;
+    state.npending = 0;
+    state.failures = 0;
+    sbuf_init(&state.buf);
+    bool sent_fds = false;
+    bool ok = true;
+    char *line = NULL;
+    size_t line_size = 0;
+    int lineno = 0;
+    while (ok && getline(&line, &line_size, stdin) >= 0) {
+        lineno++;
+        char **words = parse_args(line, false);
+        if (words == NULL || words[0] == NULL || words[0][0] == '#') {
+            free(words);
+            continue;
+        }
+        int nwords = 0;
+        while (words[nwords] != NULL)
+            nwords++;
+        struct command *command = find_command(words[0]);
+        if ((command == NULL && index(words[0], '/') == NULL)
+            || (command != NULL
+                && (command->options & COMMAND_WITH_SERVER) != 0)) {
+            fprintf(stderr, "domterm batch: line %d: %s command '%s'\n",
+                    lineno, command == NULL ? "unknown" : "invalid",
+                    words[0]);
+            state.failures++;
+            free(words);
+            continue;
+        }
+        if (command != NULL && (command->options & COMMAND_IN_SERVER) == 0) {
+            // Runs here, and may write to the terminal, so keep order.
+            while (ok && state.npending > 0)
+                ok = batch_reply(&state);
+            if (! ok) {
+                free(words);
+                break;
+            }
+            // The action closes its output when done, so give it copies.
+            struct options copts = *opts;
+            copts.fd_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+            copts.fd_err = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+            int status = (*command->action)(nwords, words,
+                                            NULL, NULL, NULL, &copts);
+            close_fd_copy(copts.fd_out, STDOUT_FILENO);
+            close_fd_copy(copts.fd_err, STDERR_FILENO);
+            batch_status(&state, lineno, status);
+            free(words);
+            continue;
+        }
+        if (state.npending == BATCH_MAX_PENDING && ! batch_reply(&state)) {
+            ok = false;
+            free(words);
             break;
-        json_object_array_add(jenv, json_object_new_string(e));
+        }
+        struct batch_command *bc =
+            &state.pending[(state.first + state.npending) % BATCH_MAX_PENDING];
+        bc->line = lineno;
+        bc->words = words;
+        bc->argc = nprefix + nwords;
+        bc->argv = xmalloc((bc->argc + 1) * sizeof(char*));
+        memcpy(bc->argv, prefix, nprefix * sizeof(char*));
+        memcpy(bc->argv + nprefix, words, (nwords + 1) * sizeof(char*));
+        state.npending++;
+        // The first command sends the environment and our output fds;
+        // the server keeps both for the rest of the connection.
+        command_message(&state.buf, state.cwd, bc->argc, bc->argv,
+                        environ, ! sent_fds);
+        if (sent_fds)
+            ok = send_all(socket, state.buf.buffer, state.buf.len);
+        else
+            ok = sent_fds = send_with_fds(socket, &state.buf);
+    }
+    while (state.npending > 0) {
+        if (! batch_reply(&state))
+            ok = false;
     }
-    json_object_object_add(jobj, "cwd", json_object_new_string(cwd));
-    free(cwd);
-    json_object_object_add(jobj, "argv", jargv);
-    json_object_object_add(jobj, "env", jenv);
-    return jobj;
+    if (! ok) {
+        fprintf(stderr, "domterm batch: lost connection to server\n");
+        state.failures++;
+    }
+    free(line);
+    free((char *) state.cwd);
+    sbuf_free(&state.buf);
+    return state.failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 void  init_options(struct options *opts)
@@ -822,6 +1148,20 @@ void  init_options(struct options *opts)
     opts->settings_file = NULL;
     opts->shell_command = NULL;
     opts->shell_argv = NULL;
+    opts->lag_limit = 0;
+    opts->window_floor = DEFAULT_WINDOW_FLOOR;
+    opts->window_ceiling = DEFAULT_WINDOW_CEILING;
+    opts->flood_rate = DEFAULT_FLOOD_RATE;
+    opts->frame_rate = DEFAULT_FRAME_RATE;
+    opts->interactive_delay = DEFAULT_INTERACTIVE_DELAY;
+    opts->bulk_delay = DEFAULT_BULK_DELAY;
+    opts->input_limit = DEFAULT_INPUT_LIMIT;
+    opts->screen_model = false;
+    opts->screen_scrollback = DEFAULT_SCREEN_SCROLLBACK;
+    opts->detached_output_limit = DEFAULT_DETACHED_OUTPUT_LIMIT;
+    opts->pty_threads = 0;
+    opts->service_threads = 1;
+    opts->warm_pool = 0;
 }
 
 static char **default_argv = NULL;
@@ -1031,6 +1371,54 @@ int process_options(int argc, char **argv, struct options *opts)
     return 0;
 }
 
+#if USE_SERVICE_THREADS
+static pthread_t *service_thread_ids;
+
+static void *
+service_thread_run(void *arg)
+{
+    service_tsi = (int) (intptr_t) arg;
+    while (!force_exit)
+        lws_service_tsi(context, 100, service_tsi);
+    return NULL;
+}
+
+/* Start the service threads other than the main one (which has tsi 0). */
+static void
+start_service_threads(void)
+{
+    if (service_threads <= 1)
+        return;
+    service_thread_ids = xmalloc(service_threads * sizeof(pthread_t));
+    // Signals are handled by the main thread.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int tsi = 1; tsi < service_threads; tsi++) {
+        if (pthread_create(&service_thread_ids[tsi], NULL, service_thread_run,
+                           (void *) (intptr_t) tsi) != 0) {
+            // Connections may already be assigned to this thread.
+            lwsl_err("cannot start service thread: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    lwsl_notice("started %d service threads\n", service_threads);
+}
+
+static void
+stop_service_threads(void)
+{
+    if (service_threads <= 1)
+        return;
+    lws_cancel_service(context);
+    for (int tsi = 1; tsi < service_threads; tsi++)
+        pthread_join(service_thread_ids[tsi], NULL);
+    free(service_thread_ids);
+    service_threads = 1;
+}
+#endif
+
 int
 main(int argc, char **argv)
 {
@@ -1079,8 +1467,16 @@ main(int argc, char **argv)
     int socket = -1;
     if ((command == NULL ||
          (command->options &
-          (COMMAND_IN_CLIENT_IF_NO_SERVER|COMMAND_IN_SERVER)) != 0))
+          (COMMAND_IN_CLIENT_IF_NO_SERVER|COMMAND_IN_SERVER
+           |COMMAND_WITH_SERVER)) != 0))
       socket = client_connect(make_socket_name(false), 0);
+    if (command != NULL && (command->options & COMMAND_WITH_SERVER) != 0) {
+        if (socket < 0) {
+            fprintf(stderr, "domterm: no server running\n");
+            exit(EXIT_FAILURE);
+        }
+        exit(run_batch(socket, optind, argv, &opts));
+    }
     if (command != NULL
         && ((command->options & COMMAND_IN_CLIENT) != 0
             || ((command->options & COMMAND_IN_CLIENT_IF_NO_SERVER) != 0
@@ -1088,48 +1484,9 @@ main(int argc, char **argv)
           exit((*command->action)(argc-optind, argv+optind,
                                   NULL, NULL, NULL, &opts));
     if (socket >= 0) {
-        json_object *jobj = state_to_json(argc, argv, environ);
-        const char *state_as_json = json_object_to_json_string_ext(jobj, JSON_C_TO_STRING_PLAIN);
-
-        size_t jlen = strlen(state_as_json);
-
-        struct msghdr msg;
-        int myfds[2];
-        myfds[0] = STDOUT_FILENO;
-        myfds[1] = STDERR_FILENO;
-        union u { // for alignment
-          char buf[CMSG_SPACE(sizeof myfds)];
-          struct cmsghdr align;
-        } u;
-        msg.msg_control = u.buf;
-        msg.msg_controllen = sizeof u.buf;
-        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 2);
-        memcpy(CMSG_DATA(cmsg), myfds, sizeof(int) * 2);
-        msg.msg_controllen = cmsg->cmsg_len;
-        cmsg->cmsg_level = SOL_SOCKET;
-        cmsg->cmsg_type = SCM_RIGHTS;
-        struct iovec iov[2];
-        iov[0].iov_base = (char*) state_as_json;
-        iov[0].iov_len = jlen;
-        iov[1].iov_base = "\f";
-        iov[1].iov_len = 1;
-        msg.msg_name = NULL;
-        msg.msg_namelen = 0;
-        msg.msg_iov = iov;
-        msg.msg_iovlen = 2;
-        msg.msg_flags = 0;
-        errno = 0;
-        ssize_t n1 = sendmsg(socket, &msg, 0);
-        close(STDOUT_FILENO);
-        close(STDERR_FILENO);
-        json_object_put(jobj);
-        char ret = -1;
-        ssize_t n2 = read(socket, &ret, 1);
-        if (n1 < 0 || n2 != 1)
-             ret = -1;
-        //if (close(socket) != 0)
-        //  fatal("bad close of socket");
+        char *cwd = getcwd(NULL, 0); /* FIXME used GNU extension */
+        int ret = send_command(socket, cwd, argc, argv, environ);
+        free(cwd);
         close(socket);
         exit(ret);
     }
@@ -1191,11 +1548,19 @@ main(int argc, char **argv)
     signal(SIGINT, sig_handler);  // ^C
     signal(SIGTERM, sig_handler); // kill
 
+#if USE_SERVICE_THREADS
+    if (opts.service_threads > 1)
+        info.count_threads = opts.service_threads;
+#endif
     context = lws_create_context(&info);
     if (context == NULL) {
         lwsl_err("libwebsockets init failed\n");
         return 1;
     }
+#if USE_SERVICE_THREADS
+    // lws limits the count to LWS_MAX_SMP.
+    service_threads = lws_get_count_threads(context);
+#endif
     vhost = lws_create_vhost(context, &info);
 #if LWS_LIBRARY_VERSION_MAJOR >= 3
     http_port = lws_get_vhost_port(vhost);
@@ -1252,11 +1617,32 @@ main(int argc, char **argv)
 #endif
     }
 
+#if USE_PTY_THREADS
+    // Several service threads already spread reading over cores.
+    if (service_threads > 1 && opts.pty_threads > 0)
+        lwsl_notice("server.pty-threads ignored with several service threads\n");
+    else
+        ptyio_start(opts.pty_threads);
+#endif
+#if USE_SERVICE_THREADS
+    start_service_threads();
+#endif
+
     // libwebsockets main loop
     while (!force_exit) {
         lws_service(context, 100);
+        // Between requests, start shells for session.warm-pool.
+        lock_service();
+        refill_shell_pools();
+        unlock_service();
     }
 
+#if USE_SERVICE_THREADS
+    stop_service_threads();
+#endif
+#if USE_PTY_THREADS
+    ptyio_stop();
+#endif
     lws_context_destroy(context);
 
     // cleanup
@@ -1526,9 +1912,11 @@ make_main_html_text(struct sbuf *obuf, int port)
                 SERVER_KEY_LENGTH, server_key, port
         );
 }
+const char html_text_end[] = "</body>\n</html>\n";
+
+/* The start of a page, up to (and including) the <body> tag. */
 void
-make_html_text(struct sbuf *obuf, int port, int hoptions,
-               const char *body_text, int body_length)
+make_html_head(struct sbuf *obuf, int port, int hoptions)
 {
     char base[40];
     bool simple = (hoptions & LIB_WHEN_OUTER) == 0;
@@ -1562,10 +1950,17 @@ make_html_text(struct sbuf *obuf, int port, int hoptions,
                     "DomTerm.server_key = '%.*s';\n"
                     "</script>\n",
                     port, SERVER_KEY_LENGTH, server_key);
-    sbuf_printf(obuf,
-                "</head>\n"
-                "<body>%.*s</body>\n"
-                "</html>\n", body_length, body_text);
+    sbuf_printf(obuf, "</head>\n<body>");
+}
+
+void
+make_html_text(struct sbuf *obuf, int port, int hoptions,
+               const char *body_text, int body_length)
+{
+    make_html_head(obuf, port, hoptions);
+    if (body_length > 0)
+        sbuf_append(obuf, body_text, body_length);
+    sbuf_printf(obuf, "%s", html_text_end);
 }
 
 static void
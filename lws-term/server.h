@@ -21,6 +21,7 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <assert.h>
 
@@ -36,6 +37,26 @@
 #include <json.h>
 
 #include "utils.h"
+#include "screen.h"
+
+// Reading pty output in separate threads (see ptyio.c) uses epoll,
+// and lws_cancel_service to wake the service thread.
+#if defined(__linux__) && LWS_LIBRARY_VERSION_NUMBER >= (3*1000000)
+#define USE_PTY_THREADS 1
+#else
+#define USE_PTY_THREADS 0
+#endif
+
+// Several lws service threads (see server.service-threads) need
+// lws_cancel_service_pt and LWS_CALLBACK_EVENT_WAIT_CANCELLED.
+#if LWS_LIBRARY_VERSION_NUMBER >= (3*1000000)
+#define USE_SERVICE_THREADS 1
+#else
+#define USE_SERVICE_THREADS 0
+#endif
+
+// lws_set_timer_usecs and LWS_CALLBACK_TIMER.
+#define USE_LWS_TIMER (LWS_LIBRARY_VERSION_NUMBER >= (3*1000000))
 
 #define SERVER_KEY_LENGTH 20
 extern char server_key[SERVER_KEY_LENGTH];
@@ -48,6 +69,8 @@ extern struct lws_context *context;
 extern struct tty_server *server;
 extern struct lws_vhost *vhost;
 extern struct pty_client *pty_client_list;
+extern int service_threads; // number of lws service threads
+extern __thread int service_tsi; // index of the current service thread
 extern int http_port;
 //extern struct tty_client *focused_client;
 extern struct lws_context_creation_info info; // FIXME rename
@@ -58,9 +81,15 @@ extern struct options *main_options;
 extern const char *settings_as_json;
 extern char git_describe[];
 
+// Hash indexes of sessions (see session_index_add in protocol.c).
+enum { SESSION_BY_PID, SESSION_BY_NUMBER, SESSION_BY_NAME, SESSION_INDEXES };
+
 /** Data specific to a pty process. */
 struct pty_client {
     struct pty_client *next_pty_client;
+    struct pty_client *prev_pty_client;
+    struct pty_client *index_next[SESSION_INDEXES]; // hash chains
+    struct shell_pool *pool; // if an idle shell, not yet a session
     int pid;
     int pty;
     int session_number;
@@ -81,16 +110,66 @@ struct pty_client {
     struct tty_client *recent_tclient;
     char *saved_window_contents;
     char *ttyname;
+    struct termios termios; // cached modes of pty (see pty_termios)
+    bool termios_valid;
+    struct screen *screen; // headless model of the terminal state, or NULL
+
+    // Output read from the pty, shared by all the tty_clients.
+    // Each tty_client has a read position; data before the
+    // lowest position (and preserved_start, if preserving) is discarded.
+    struct ring *output;
+
+    // Flood mode: while output arrives faster than the flood-rate,
+    // only periodic screen deltas (frames) are sent (needs the screen).
+    bool flooding;
+    int flood_intervals; // consecutive fast rate intervals
+    long rate_bytes; // bytes read in the current rate interval
+    int64_t rate_start; // start time of the current rate interval
+
+    // Output coalescing: windows are told about new output after a delay
+    // that depends on whether the session seems interactive or bulk.
+    bool flush_pending; // the timer will tell the windows
+    bool bulk_output; // using the bulk profile
+    long unflushed; // bytes read since the windows were last told
+    double input_level; // recent input events (decaying)
+    double output_level; // recent output bytes (decaying)
+    int64_t level_time; // when the levels were last updated
+    int64_t input_time; // time of the most recent input
 
     // The following are used to attach to already-visible session.
-    char *preserved_output; // data send since window-contents request
-    size_t preserved_start; // start of valid data in preserved_output
-#define PRESERVE_MIN 0
-    size_t preserved_end; // end of valid data in preserved_output
-    size_t preserved_size; // allocated size of preserved_output
-    long preserved_sent_count;  // sent_count corresponding to preserved_output
+    bool preserving; // output since window-contents request is kept
+    long preserved_start; // output position of window-contents request
+    long preserved_sent_count;  // sent_count corresponding to preserved_start
+    // Preserved output read while no window was attached, just before
+    // preserved_start.  (NULL until needed.)
+    struct spool *spool;
+    struct pty_chunk *chunk; // non-NULL if read by a pty thread
+
+    // Service thread of pty_wsi (-1 until its first callback), and
+    // requests for that thread (see run_thread_requests).
+    int tsi;
+    bool unpause_requested;
+    bool close_requested;
+    bool writable_requested;
+
+    // Input not yet written to the pty, which would have blocked.
+    struct sbuf pending_input;
+    long input_queued; // total bytes of input (written or pending)
+    long input_written; // total bytes written to the pty (or discarded)
 };
 
+#define FLOW_SAMPLES 8
+/** Records when output up to a given sent_count was sent. */
+struct flow_sample {
+    long count; // sent_count after sending
+    long confirmed; // confirmed_count when sent
+    int64_t time; // when sent, in microseconds
+    int64_t confirmed_time; // start of delivery-rate interval
+};
+
+// More than the number of unacknowledged paste chunks the browser sends.
+#define PASTE_WINDOW 8
+
 /** Data specific to a (browser) client connection. */
 struct tty_client {
     struct pty_client *pclient;
@@ -110,17 +189,50 @@ struct tty_client {
     // both sent_count and confirmed_count are modulo MASK28.
     long sent_count; // # bytes sent to (any) tty_client
     long confirmed_count; // # bytes confirmed received from (some) tty_client
+    // Flow control: window is the limit on unconfirmed bytes.
+    // It is adapted to the measured round-trip time and delivery rate.
+    long window;
+    long rtt; // smoothed round-trip time in microseconds; 0 if unknown
+    long min_rtt; // recent minimum round-trip time
+    int64_t min_rtt_time; // when min_rtt was measured
+    double delivery_rate; // recent maximum, in bytes per second
+    int64_t confirmed_time; // when confirmed_count was last updated
+    struct flow_sample samples[FLOW_SAMPLES]; // not yet confirmed
+    int nsamples;
     struct lws *wsi;
     // data received from client and not yet processed.
     // (Normally, this is only if an incomplete reportEvent message.)
-    char *buffer;
-    size_t len; // length of data in buffer
+    // The buffer is reused for each message.
+    struct sbuf inbuf;
     struct lws *next_client_wsi;
-    struct sbuf ob; // output from child process
-    size_t ocount; // amount to increment sent_count (ocount <= olen)
+    struct sbuf ob; // urgent messages for client (not counted)
+    struct sbuf wb; // frame being written (reused; LWS_PRE headroom)
+    struct ring *output; // reference to pclient->output (or NULL)
+    long output_pos; // position in output of next byte to send
+    // 1: too far behind - detached from live output (see lag_limit)
+    // 2: caught up - waiting for window contents to resynchronize
+    char lagging;
     int connection_number;
     int pty_window_number; // Numbered within each pty_client; -1 if only one
     bool pty_window_update_needed;
+    int tsi; // service thread of wsi
+    char requests; // REQUEST_* bits of other threads; in tty_requests if set
+    bool input_paused; // rx flow control, while pty input is pending
+
+    // A large paste streamed in chunks by the browser (see event_paste_data).
+    int paste_id; // -1 if none
+    bool paste_bracketed;
+    bool paste_ended; // waiting for the last chunks to be written
+    long paste_start; // pclient->input_queued at start of paste
+    int paste_chunks; // chunks received
+    int paste_acked; // chunks acknowledged (written to the pty)
+    long paste_ends[PASTE_WINDOW]; // input_queued after each chunk
+    int exit_status; // of the session's process, if known; else -1
+    // The session's process, until it exits, if the window waits for
+    // its exit status (see process_exited); else 0.
+    pid_t waiting_pid;
+    struct tty_client *next_exit_waiter;
+    struct tty_client *next_request;
 };
 
 struct http_client {
@@ -128,12 +240,63 @@ struct http_client {
     char *data;
     char *ptr;
     int length;
+    // The response continues with file_remaining bytes read from
+    // file_fd (into data, if owns_data), and then trailer (if non-NULL).
+    int file_fd;
+    off_t file_remaining;
+    const char *trailer;
 };
 
+// Most fds passed (and not yet used) on a command connection.
+#define CMD_MAX_FDS 8
+// Longest message on a command connection.
+#define CMD_MAX_MESSAGE (16*1024*1024)
+/* A command message (after its length line) is:
+ * the version byte CMD_PROTOCOL_VERSION; CMD_ENV_FULL or CMD_ENV_DIGEST;
+ * the digest of the environment (8 bytes); the argument count,
+ * the environment count and the total length of the environment
+ * strings (4 bytes each); then the NUL-terminated cwd and arguments,
+ * followed (only for CMD_ENV_FULL) by the environment strings.
+ * Integers are big-endian.  The reply is CMD_REPLY_RESULT and the
+ * exit code, or CMD_REPLY_NEED_ENV and 0 if the server doesn't have
+ * the environment, in which case the client sends it in full.
+ * The server keeps the last environment sent in full on a connection
+ * for the rest of it, so later messages with the same environment
+ * never get CMD_REPLY_NEED_ENV (see "domterm batch").
+ */
+#define CMD_PROTOCOL_VERSION 2
+#define CMD_ENV_FULL 'F'
+#define CMD_ENV_DIGEST 'D'
+#define CMD_REPLY_RESULT 'R'
+#define CMD_REPLY_NEED_ENV 'E'
+#define CMD_HEADER_LENGTH 22
+
+/** The command socket, or a connection to it from a client. */
 struct cmd_client {
     int socket;
+    bool connection; // false for the listening socket
+    struct sbuf rbuf; // data received but not yet handled
+    int fds[CMD_MAX_FDS]; // fds received but not yet used
+    int nfds;
+    int fd_out, fd_err; // the client's output and error, or -1
+    // The last environment sent in full on the connection (or NULL),
+    // as in the server's cache of environments.
+    char **env;
+    uint64_t env_digest;
+    uint32_t envc;
+    size_t env_length;
 };
 #define MASK28 0xfffffff
+#define DEFAULT_WINDOW_FLOOR 8000
+#define MIN_WINDOW_FLOOR 1024
+#define DEFAULT_WINDOW_CEILING (1024*1024)
+#define DEFAULT_SCREEN_SCROLLBACK 2000
+#define DEFAULT_FLOOD_RATE (1024*1024)
+#define DEFAULT_FRAME_RATE 20
+#define DEFAULT_DETACHED_OUTPUT_LIMIT (1024*1024)
+#define DEFAULT_INTERACTIVE_DELAY 0
+#define DEFAULT_BULK_DELAY 4
+#define DEFAULT_INPUT_LIMIT (1024*1024)
 
 struct options {
     bool readonly;                            // whether not allow clients to write to the TTY
@@ -174,6 +337,20 @@ struct options {
     char *settings_file;
     char *shell_command;
     char **shell_argv;                        // parse_args(shell_command);
+    long lag_limit;                           // flow.lag-limit setting; 0 for none
+    long window_floor;                        // flow.window-floor setting
+    long window_ceiling;                      // flow.window-ceiling setting
+    long flood_rate;                          // flow.flood-rate setting; 0 for none
+    long frame_rate;                          // flow.frame-rate setting
+    long interactive_delay;                   // flow.interactive-delay setting, in ms
+    long bulk_delay;                          // flow.bulk-delay setting, in ms
+    long input_limit;                         // flow.input-limit setting
+    bool screen_model;                        // session.screen-model setting
+    long screen_scrollback;                   // session.screen-scrollback setting
+    long detached_output_limit;               // session.detached-output-limit setting
+    long pty_threads;                         // server.pty-threads setting
+    long service_threads;                     // server.service-threads setting
+    long warm_pool;                           // session.warm-pool setting
 };
 
 struct tty_server {
@@ -201,6 +378,33 @@ callback_pty(struct lws *wsi, enum lws_callback_reasons reason, void *user, void
 extern int
 callback_cmd(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
 
+extern int
+callback_reaper(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
+extern int end_process(pid_t pid, int sig);
+extern int exit_code(int status);
+extern void process_exited(pid_t pid, int status);
+extern void refill_shell_pools(void);
+
+#if USE_PTY_THREADS
+extern void ptyio_start(int count);
+extern void ptyio_stop(void);
+extern bool ptyio_add(struct pty_client *pclient);
+extern void ptyio_resume(struct pty_client *pclient);
+extern void ptyio_remove(struct pty_client *pclient);
+extern void ptyio_drain(void);
+extern void pty_chunk_ready(struct pty_client *pclient, char pcmd,
+                            const char *data, ssize_t length);
+#endif
+
+extern int service_unlock_all(void);
+extern void service_relock(int depth);
+extern void request_writable(struct lws *wsi);
+extern struct termios *pty_termios(struct pty_client *pclient);
+extern void setblocking(int fd, int state);
+#if USE_SERVICE_THREADS
+extern void run_thread_requests(void);
+#endif
+
 extern int
 callback_inotify(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
 
@@ -252,17 +456,14 @@ extern void copy_html_file(FILE*in, FILE*out);
 #define LIB_AS_MODULE 8
 extern void make_html_text(struct sbuf *obuf, int port, int options,
                            const char *body_text, int body_length);
+extern void make_html_head(struct sbuf *obuf, int port, int options);
+extern const char html_text_end[];
 extern char** parse_args(const char*, bool);
 extern const char *extract_command_from_list(const char *, const char **,
                                              const char**, const char **);
 
 #if COMPILED_IN_RESOURCES
-struct resource {
-  char *name;
-  unsigned char *data;
-  unsigned int length;
-};
-extern struct resource resources[];
+#include "resources.h"
 #endif
 
 #define FOREACH_WSCLIENT(VAR, PCLIENT)      \
@@ -278,6 +479,8 @@ extern struct resource resources[];
 #define COMMAND_IN_CLIENT 2
 #define COMMAND_IN_CLIENT_IF_NO_SERVER 4
 #define COMMAND_IN_SERVER 8
+// Run in the client, using a connection to a running server.
+#define COMMAND_WITH_SERVER 16
 
 /* The procedure that executes a command.
  * The return value should be one of EXIT_SUCCESS, EXIT_FAILURE,
@@ -304,6 +507,8 @@ extern int help_action(int, char**, const char*, char **,
                        struct lws *, struct options *);
 extern int new_action(int, char**, const char*, char **,
                       struct lws *, struct options *);
+extern int batch_action(int, char**, const char*, char **,
+                        struct lws *, struct options *);
 extern void print_version(FILE*);
 extern char*find_in_path();
 extern void print_help(FILE*);
@@ -37,6 +37,53 @@ callback_inotify(struct lws *wsi, enum lws_callback_reasons reason,
 }
 #endif
 
+/** Parse a non-negative number, optionally followed by 'k' or 'm'. */
+static bool
+parse_numeric_setting(const char *value, size_t length, long *result)
+{
+    char buf[40];
+    if (length == 0 || length >= sizeof(buf))
+        return false;
+    memcpy(buf, value, length);
+    buf[length] = '\0';
+    char *end;
+    errno = 0;
+    long val = strtol(buf, &end, 10);
+    if (end == buf || val < 0 || errno == ERANGE)
+        return false;
+    long scale = 1;
+    if (*end == 'k' || *end == 'K')
+        scale = 1024;
+    else if (*end == 'm' || *end == 'M')
+        scale = 1024 * 1024;
+    if (scale != 1) {
+        if (val > LONG_MAX / scale)
+            return false;
+        val *= scale;
+        end++;
+    }
+    if (*end != '\0')
+        return false;
+    *result = val;
+    return true;
+}
+
+/** Parse true/yes/on or false/no/off. */
+static bool
+parse_boolean_setting(const char *value, size_t length, bool *result)
+{
+    static const char *const names[] = { "true", "yes", "on",
+                                         "false", "no", "off" };
+    for (int i = 0; i < 6; i++) {
+        if (strlen(names[i]) == length
+            && strncmp(value, names[i], length) == 0) {
+            *result = i < 3;
+            return true;
+        }
+    }
+    return false;
+}
+
 void
 read_settings_file(struct options *options)
 {
@@ -79,6 +126,20 @@ read_settings_file(struct options *options)
     CLEAR_FIELD(command_chrome);
     CLEAR_FIELD(command_electron);
     CLEAR_FIELD(default_frontend);
+    options->lag_limit = 0;
+    options->window_floor = DEFAULT_WINDOW_FLOOR;
+    options->window_ceiling = DEFAULT_WINDOW_CEILING;
+    options->flood_rate = DEFAULT_FLOOD_RATE;
+    options->frame_rate = DEFAULT_FRAME_RATE;
+    options->interactive_delay = DEFAULT_INTERACTIVE_DELAY;
+    options->bulk_delay = DEFAULT_BULK_DELAY;
+    options->input_limit = DEFAULT_INPUT_LIMIT;
+    options->screen_model = false;
+    options->screen_scrollback = DEFAULT_SCREEN_SCROLLBACK;
+    options->detached_output_limit = DEFAULT_DETACHED_OUTPUT_LIMIT;
+    options->pty_threads = 0;
+    options->service_threads = 1;
+    options->warm_pool = 0;
 
     char *emsg = "";
     for (;;) {
@@ -177,6 +238,34 @@ read_settings_file(struct options *options)
         HANDLE_SETTING("command.electron", command_electron);
         HANDLE_SETTING("frontend.default", default_frontend);
 
+#define HANDLE_NUMERIC_SETTING(NAME, FIELD)                   \
+        if (strcmp(key_start, NAME) == 0                      \
+            && ! parse_numeric_setting(value_start, value_length, \
+                                       &options->FIELD))      \
+            fprintf(stderr, "bad numeric value for %s\n", NAME);
+
+        HANDLE_NUMERIC_SETTING("flow.lag-limit", lag_limit);
+        HANDLE_NUMERIC_SETTING("flow.window-floor", window_floor);
+        HANDLE_NUMERIC_SETTING("flow.window-ceiling", window_ceiling);
+        HANDLE_NUMERIC_SETTING("flow.flood-rate", flood_rate);
+        HANDLE_NUMERIC_SETTING("flow.frame-rate", frame_rate);
+        HANDLE_NUMERIC_SETTING("flow.interactive-delay", interactive_delay);
+        HANDLE_NUMERIC_SETTING("flow.bulk-delay", bulk_delay);
+        HANDLE_NUMERIC_SETTING("flow.input-limit", input_limit);
+        HANDLE_NUMERIC_SETTING("session.screen-scrollback", screen_scrollback);
+        HANDLE_NUMERIC_SETTING("session.detached-output-limit", detached_output_limit);
+        HANDLE_NUMERIC_SETTING("session.warm-pool", warm_pool);
+        HANDLE_NUMERIC_SETTING("server.pty-threads", pty_threads);
+        HANDLE_NUMERIC_SETTING("server.service-threads", service_threads);
+
+#define HANDLE_BOOLEAN_SETTING(NAME, FIELD)                   \
+        if (strcmp(key_start, NAME) == 0                      \
+            && ! parse_boolean_setting(value_start, value_length, \
+                                       &options->FIELD))      \
+            fprintf(stderr, "bad boolean value for %s\n", NAME);
+
+        HANDLE_BOOLEAN_SETTING("session.screen-model", screen_model);
+
         json_object_object_add(jobj, key_start,
                 json_object_new_string_len(value_start, value_length));
     }
@@ -184,6 +273,19 @@ read_settings_file(struct options *options)
     fprintf(stderr, "error in %s at byte offset %ld%s\n",
             settings_fname, (long) (sptr - sbuf), emsg);
  eof:
+    // A window too small for any output would pause a session for good.
+    if (options->window_floor < MIN_WINDOW_FLOOR) {
+        fprintf(stderr, "flow.window-floor must be at least %d - using %d\n",
+                MIN_WINDOW_FLOOR, DEFAULT_WINDOW_FLOOR);
+        options->window_floor = DEFAULT_WINDOW_FLOOR;
+    }
+    if (options->window_ceiling < options->window_floor) {
+        long ceiling = DEFAULT_WINDOW_CEILING < options->window_floor
+            ? options->window_floor : DEFAULT_WINDOW_CEILING;
+        fprintf(stderr, "flow.window-ceiling is less than flow.window-floor"
+                " - using %ld\n", ceiling);
+        options->window_ceiling = ceiling;
+    }
     if (options->shell_argv)
         free(options->shell_argv);
     options->shell_argv = parse_args(options->shell_command, false);
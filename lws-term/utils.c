@@ -15,6 +15,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <zlib.h>
 #include "whereami.h"
 #if HAVE_GETRANDOM
 extern int getrandom(void *buf, size_t buflen, unsigned int flags);
@@ -105,6 +106,117 @@ base64_encode(const unsigned char *buffer, size_t length) {
     return ret;
 }
 
+static int
+hex4(const char *p)
+{
+    int val = 0;
+    for (int i = 0; i < 4; i++) {
+        char ch = p[i];
+        int d = ch >= '0' && ch <= '9' ? ch - '0'
+            : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10
+            : ch >= 'A' && ch <= 'F' ? ch - 'A' + 10
+            : -1;
+        if (d < 0)
+            return -1;
+        val = (val << 4) | d;
+    }
+    return val;
+}
+
+/* A 64-bit FNV-1a hash of the strings, including their NULs. */
+uint64_t
+string_array_digest(char *const*strings)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (; *strings != NULL; strings++) {
+        const unsigned char *p = (const unsigned char *) *strings;
+        do {
+            h = (h ^ *p) * 1099511628211ULL;
+        } while (*p++ != 0);
+    }
+    return h;
+}
+
+/* Close fd, a copy of orig given to a command action (which may have
+ * closed it itself, after which the number may have been reused).
+ */
+void
+close_fd_copy(int fd, int orig)
+{
+    struct stat fst, ost;
+    if (fd >= 0 && fstat(fd, &fst) == 0 && fstat(orig, &ost) == 0
+        && fst.st_dev == ost.st_dev && fst.st_ino == ost.st_ino)
+        close(fd);
+}
+
+/* Decode a JSON string literal, without building a json-c object.
+ * src (before end) must start with '"'; anything after the closing
+ * quote is ignored.  The result (which is not NUL-terminated) is
+ * never longer than the literal, so dst may be the same as src.
+ * Returns the length of the result, or -1 if the literal is invalid.
+ */
+long
+json_unescape(const char *src, const char *end, char *dst)
+{
+    char *out = dst;
+    if (src >= end || *src++ != '"')
+        return -1;
+    for (;;) {
+        if (src >= end)
+            return -1;
+        char ch = *src++;
+        if (ch == '"')
+            return out - dst;
+        if (ch != '\\') {
+            *out++ = ch;
+            continue;
+        }
+        if (src >= end)
+            return -1;
+        ch = *src++;
+        switch (ch) {
+        case '"': case '\\': case '/': *out++ = ch; break;
+        case 'b': *out++ = '\b'; break;
+        case 'f': *out++ = '\f'; break;
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+        case 'u': {
+            int c = end - src >= 4 ? hex4(src) : -1;
+            if (c < 0)
+                return -1;
+            src += 4;
+            if (c >= 0xD800 && c < 0xDC00 && end - src >= 6
+                && src[0] == '\\' && src[1] == 'u') {
+                int c2 = hex4(src + 2);
+                if (c2 >= 0xDC00 && c2 < 0xE000) {
+                    c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+                    src += 6;
+                }
+            }
+            if (c < 0x80)
+                *out++ = c;
+            else if (c < 0x800) {
+                *out++ = 0xC0 | (c >> 6);
+                *out++ = 0x80 | (c & 0x3F);
+            } else if (c < 0x10000) {
+                *out++ = 0xE0 | (c >> 12);
+                *out++ = 0x80 | ((c >> 6) & 0x3F);
+                *out++ = 0x80 | (c & 0x3F);
+            } else {
+                *out++ = 0xF0 | (c >> 18);
+                *out++ = 0x80 | ((c >> 12) & 0x3F);
+                *out++ = 0x80 | ((c >> 6) & 0x3F);
+                *out++ = 0x80 | (c & 0x3F);
+            }
+            break;
+        }
+        default:
+            return -1;
+        }
+    }
+}
+
 /* Parse an argument list (a list of possible-quoted "words").
  * This follows extended shell syntax.
  * If check_shell_specials is true and
@@ -545,3 +657,315 @@ sbuf_printf(struct sbuf *buf, const char *format, ...)
     sbuf_vprintf(buf, format, ap);
     va_end(ap);
 }
+
+void
+sbuf_append(struct sbuf *buf, const char *data, size_t length)
+{
+    sbuf_extend(buf, length);
+    memcpy(buf->buffer + buf->len, data, length);
+    buf->len += length;
+}
+
+#define RING_MIN_SIZE 4096
+
+struct ring *
+ring_new(size_t headroom)
+{
+    struct ring *ring = xmalloc(sizeof(struct ring));
+    ring->data = NULL;
+    ring->size = 0;
+    ring->headroom = headroom;
+    ring->start = 0;
+    ring->end = 0;
+    ring->refcount = 1;
+    ring->pinned = 0;
+    return ring;
+}
+
+struct ring *
+ring_ref(struct ring *ring)
+{
+    ring->refcount++;
+    return ring;
+}
+
+void
+ring_unref(struct ring *ring)
+{
+    if (ring == NULL || --ring->refcount > 0)
+        return;
+    if (ring->data != NULL)
+        free(ring->data - ring->headroom);
+    free(ring);
+}
+
+/* Make sure there is room for at least 'needed' more bytes. */
+void
+ring_reserve(struct ring *ring, size_t needed)
+{
+    size_t used = ring->end - ring->start;
+    if (used + needed <= ring->size)
+        return;
+    size_t nsize = ring->size > 0 ? ring->size : RING_MIN_SIZE;
+    while (nsize < used + needed)
+        nsize <<= 1;
+    char *ndata = (char *) xmalloc(ring->headroom + nsize) + ring->headroom;
+    if (ring->data != NULL) {
+        // Copy so each retained position maps to its new slot.
+        long pos = ring->start;
+        while (pos < ring->end) {
+            char *src;
+            size_t n = ring_span(ring, pos, ring->end, &src);
+            size_t off = pos & (nsize - 1);
+            size_t first = nsize - off < n ? nsize - off : n;
+            memcpy(ndata + off, src, first);
+            memcpy(ndata, src + first, n - first);
+            pos += n;
+        }
+        free(ring->data - ring->headroom);
+    }
+    ring->data = ndata;
+    ring->size = nsize;
+}
+
+/* Set iov[0..1] to the free space after end; return the number of spans. */
+int
+ring_free_spans(struct ring *ring, struct iovec *iov)
+{
+    size_t mask = ring->size - 1;
+    size_t avail = ring->size - (ring->end - ring->start);
+    size_t off = ring->end & mask;
+    size_t first = ring->size - off;
+    if (first > avail)
+        first = avail;
+    iov[0].iov_base = ring->data + off;
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = avail - first;
+    return iov[1].iov_len > 0 ? 2 : 1;
+}
+
+/* Return length of the contiguous data starting at pos (bounded by end). */
+size_t
+ring_span(struct ring *ring, long pos, long end, char **ptr)
+{
+    size_t off = pos & (ring->size - 1);
+    size_t n = end - pos;
+    if (n > ring->size - off)
+        n = ring->size - off;
+    *ptr = ring->data + off;
+    return n;
+}
+
+void
+ring_copy_out(struct ring *ring, long pos, size_t length, char *dst)
+{
+    long end = pos + length;
+    while (pos < end) {
+        char *src;
+        size_t n = ring_span(ring, pos, end, &src);
+        memcpy(dst, src, n);
+        dst += n;
+        pos += n;
+    }
+}
+
+void
+ring_append(struct ring *ring, const char *data, size_t length)
+{
+    ring_reserve(ring, length);
+    struct iovec iov[2];
+    ring_free_spans(ring, iov);
+    size_t first = iov[0].iov_len < length ? iov[0].iov_len : length;
+    memcpy(iov[0].iov_base, data, first);
+    memcpy(iov[1].iov_base, data + first, length - first);
+    ring->end += length;
+}
+
+/* Discard data before pos.  Shrink back if the ring has become empty. */
+void
+ring_consume(struct ring *ring, long pos)
+{
+    if (pos > ring->end)
+        pos = ring->end;
+    if (pos > ring->start)
+        ring->start = pos;
+    if (ring->start == ring->end && ring->size > 16 * RING_MIN_SIZE
+        && ring->pinned == 0) {
+        free(ring->data - ring->headroom);
+        ring->data = NULL;
+        ring->size = 0;
+    }
+}
+
+#define SPOOL_BLOCK_SIZE 65536
+
+struct spool_block {
+    struct spool_block *next;
+    size_t length;  // uncompressed length
+    size_t zlength; // compressed length of data
+    unsigned char data[];
+};
+
+struct spool *
+spool_new(size_t limit)
+{
+    struct spool *spool = xmalloc(sizeof(struct spool));
+    spool->first = NULL;
+    spool->last = NULL;
+    spool->pending = NULL;
+    spool->pending_length = 0;
+    spool->length = 0;
+    spool->compressed = 0;
+    spool->dropped = 0;
+    spool->limit = limit;
+    return spool;
+}
+
+void
+spool_clear(struct spool *spool)
+{
+    struct spool_block *block = spool->first;
+    while (block != NULL) {
+        struct spool_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    spool->first = NULL;
+    spool->last = NULL;
+    spool->pending_length = 0;
+    spool->length = 0;
+    spool->compressed = 0;
+    spool->dropped = 0;
+}
+
+void
+spool_free(struct spool *spool)
+{
+    if (spool == NULL)
+        return;
+    spool_clear(spool);
+    free(spool->pending);
+    free(spool);
+}
+
+/* Compress the pending data into a new block,
+ * then drop the oldest blocks that are no longer needed. */
+static void
+spool_flush(struct spool *spool)
+{
+    uLongf zlength = compressBound(spool->pending_length);
+    struct spool_block *block =
+        xmalloc(sizeof(struct spool_block) + zlength);
+    if (compress2(block->data, &zlength,
+                  (unsigned char *) spool->pending, spool->pending_length,
+                  Z_BEST_SPEED) != Z_OK) {
+        lwsl_err("spool: compress failed\n");
+        free(block);
+        spool->length -= spool->pending_length;
+        spool->dropped += spool->pending_length;
+        spool->pending_length = 0;
+        return;
+    }
+    block = xrealloc(block, sizeof(struct spool_block) + zlength);
+    block->next = NULL;
+    block->length = spool->pending_length;
+    block->zlength = zlength;
+    if (spool->last == NULL)
+        spool->first = block;
+    else
+        spool->last->next = block;
+    spool->last = block;
+    spool->compressed += zlength;
+    spool->pending_length = 0;
+
+    while (spool->first != NULL
+           && spool->length - spool->first->length >= spool->limit) {
+        struct spool_block *old = spool->first;
+        spool->first = old->next;
+        if (spool->first == NULL)
+            spool->last = NULL;
+        spool->length -= old->length;
+        spool->compressed -= old->zlength;
+        spool->dropped += old->length;
+        free(old);
+    }
+}
+
+void
+spool_append(struct spool *spool, const char *data, size_t length)
+{
+    while (length > 0) {
+        if (spool->pending == NULL)
+            spool->pending = xmalloc(SPOOL_BLOCK_SIZE);
+        size_t n = SPOOL_BLOCK_SIZE - spool->pending_length;
+        if (n > length)
+            n = length;
+        memcpy(spool->pending + spool->pending_length, data, n);
+        spool->pending_length += n;
+        spool->length += n;
+        data += n;
+        length -= n;
+        if (spool->pending_length == SPOOL_BLOCK_SIZE)
+            spool_flush(spool);
+    }
+}
+
+/* Append the (uncompressed) contents of the spool to out. */
+void
+spool_copy_out(struct spool *spool, struct sbuf *out)
+{
+    sbuf_extend(out, spool->length);
+    for (struct spool_block *block = spool->first;
+         block != NULL; block = block->next) {
+        uLongf length = block->length;
+        if (uncompress((unsigned char *) out->buffer + out->len, &length,
+                       block->data, block->zlength) != Z_OK)
+            lwsl_err("spool: uncompress failed\n");
+        else
+            out->len += length;
+    }
+    sbuf_append(out, spool->pending, spool->pending_length);
+}
+
+void
+spsc_init(struct spsc_queue *queue, size_t size)
+{
+    queue->slots = xmalloc(size * sizeof(void *));
+    queue->mask = size - 1;
+    queue->head = 0;
+    queue->tail = 0;
+}
+
+void
+spsc_free(struct spsc_queue *queue)
+{
+    free(queue->slots);
+    queue->slots = NULL;
+}
+
+/* Called only by the producer thread.  Returns false if full. */
+bool
+spsc_push(struct spsc_queue *queue, void *item)
+{
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (tail - head > queue->mask)
+        return false;
+    queue->slots[tail & queue->mask] = item;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Called only by the consumer thread.  Returns NULL if empty. */
+void *
+spsc_pop(struct spsc_queue *queue)
+{
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return NULL;
+    void *item = queue->slots[head & queue->mask];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
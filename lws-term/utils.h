@@ -29,6 +29,18 @@ get_sig(const char *sig_name);
 char *
 base64_encode(const unsigned char *buffer, size_t length);
 
+// Decode a JSON string literal (in place if dst == src)
+long
+json_unescape(const char *src, const char *end, char *dst);
+
+// Hash of a NULL-terminated array of strings (such as an environment)
+uint64_t
+string_array_digest(char *const*strings);
+
+// Close a copy (made by dup) of orig, unless it was already closed
+void
+close_fd_copy(int fd, int orig);
+
 struct sbuf {
     char *buffer;
     size_t len;
@@ -41,5 +53,74 @@ extern void sbuf_extend(struct sbuf *buf, int needed);
 extern char *sbuf_blank(struct sbuf *buf, int space);
 extern void sbuf_printf(struct sbuf *buf, const char *format, ...);
 extern void sbuf_vprintf(struct sbuf *buf, const char *format, va_list ap);
+extern void sbuf_append(struct sbuf *buf, const char *data, size_t length);
+
+/** A growable circular byte buffer, shared by reference counting.
+ * Positions (start, end) are absolute byte offsets that only increase;
+ * a position maps to data[pos & (size-1)].  The 'headroom' bytes
+ * allocated before data[0] are scratch space for a header (see LWS_PRE).
+ * Only a span starting at data[0] has unused bytes in front of it;
+ * before any other span are older bytes still in the ring, so write
+ * spans as websocket frames only with write_output_span (in protocol.c),
+ * which saves and restores them.
+ */
+struct ring {
+    char *data;
+    size_t size;     // capacity of data - zero or a power of 2
+    size_t headroom;
+    long start;      // position of oldest retained byte
+    long end;        // position after newest byte
+    int refcount;
+    int pinned;      // if > 0, the free space is being written (by a
+                     // pty thread), so ring_consume must not free data
+};
+
+extern struct ring *ring_new(size_t headroom);
+extern struct ring *ring_ref(struct ring *ring);
+extern void ring_unref(struct ring *ring);
+extern void ring_reserve(struct ring *ring, size_t needed);
+extern int ring_free_spans(struct ring *ring, struct iovec *iov);
+extern size_t ring_span(struct ring *ring, long pos, long end, char **ptr);
+extern void ring_copy_out(struct ring *ring, long pos, size_t length,
+                          char *dst);
+extern void ring_append(struct ring *ring, const char *data, size_t length);
+extern void ring_consume(struct ring *ring, long pos);
+
+/** A bounded store of output, kept as zlib-compressed blocks.
+ * Once it holds more than 'limit' bytes (uncompressed),
+ * the oldest blocks are discarded.
+ */
+struct spool {
+    struct spool_block *first, *last;
+    char *pending;         // not yet compressed
+    size_t pending_length;
+    size_t length;         // uncompressed length, including pending
+    size_t compressed;     // total size of the compressed blocks
+    size_t dropped;        // bytes discarded because of the limit
+    size_t limit;
+};
+
+extern struct spool *spool_new(size_t limit);
+extern void spool_free(struct spool *spool);
+extern void spool_clear(struct spool *spool);
+extern void spool_append(struct spool *spool, const char *data,
+                         size_t length);
+extern void spool_copy_out(struct spool *spool, struct sbuf *out);
+
+/** A lock-free single-producer single-consumer queue of pointers,
+ * for handing data from one thread to another.
+ * The size (a power of 2) is fixed.
+ */
+struct spsc_queue {
+    void **slots;
+    size_t mask;    // size - 1
+    size_t head;    // next slot to pop - written by the consumer
+    size_t tail;    // next slot to push - written by the producer
+};
+
+extern void spsc_init(struct spsc_queue *queue, size_t size);
+extern void spsc_free(struct spsc_queue *queue);
+extern bool spsc_push(struct spsc_queue *queue, void *item);
+extern void *spsc_pop(struct spsc_queue *queue);
 
 #endif //TTYD_UTIL_H
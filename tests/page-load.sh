@@ -0,0 +1,40 @@
+#!/bin/bash
+# Time loading the pages of a window from a running domterm server:
+# /main.html or /simple.html, and the stylesheets and scripts they use.
+# This is roughly what a browser does when opening a new window
+# with an empty cache.
+#
+# Usage: page-load.sh PORT [COUNT]
+# where PORT is the server's http port - for example, start a server with
+#   domterm --port=8088 --detached
+# Each page is loaded COUNT times (default 20) and the average is printed.
+
+port=$1
+count=${2:-20}
+if [ -z "$port" ]; then
+    echo "usage: $0 PORT [COUNT]" >&2
+    exit 1
+fi
+base="http://127.0.0.1:$port"
+
+for page in main.html simple.html; do
+    urls=$(curl -s "$base/$page" \
+        | sed -n -e "s|.* src='\([^']*\)'.*|$base/\1|p" \
+                 -e "s|.* href='\([^']*\)'.*|$base/\1|p" \
+        | grep -v "^$base/http")
+    if [ -z "$urls" ]; then
+        echo "$page: cannot load from $base" >&2
+        exit 1
+    fi
+    bytes=0
+    start=$(date +%s%N)
+    for ((i = 0; i < count; i++)); do
+        # One connection (kept alive) for the page and its resources.
+        bytes=$(curl -s --compressed -o /dev/null -w '%{size_download}\n' \
+                     "$base/$page" $urls \
+                    | awk '{ n += $1 } END { print n }')
+    done
+    end=$(date +%s%N)
+    echo "$page: $(( (end - start) / count / 1000 )) us per load," \
+         "$(echo $urls | wc -w) resources, $bytes bytes transferred"
+done